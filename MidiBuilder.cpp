@@ -0,0 +1,1530 @@
+#include "MidiBuilder.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+
+void MidiSink::writeAll(const unsigned char * data, size_t size){
+  std::chrono::steady_clock::time_point start{};
+  if constexpr(collectStats){
+    start = std::chrono::steady_clock::now();
+    sinkStats.writes++;
+    sinkStats.bytes += size;
+  }
+  while(size){
+    ssize_t n = ::write(fd, data, size);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) throw std::runtime_error(std::string("write failed: ") + std::strerror(errno));
+    data += n;
+    size -= n;
+  }
+  if constexpr(collectStats)
+    sinkStats.writeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void MidiSink::flush(){
+  if(fd < 0) return;
+  size_t size = block.size();
+  if(!seekable && chunkOffset >= 0)
+    size = chunkOffset - blockOffset;
+  writeAll(block.data(), size);
+  block.erase(block.begin(), block.begin() + size);
+  blockOffset += size;
+}
+
+MidiSink::MidiSink(const std::string & path){
+  struct stat existing{};
+  bool exists = ::stat(path.c_str(), &existing) == 0;
+  if(path == "-"){
+    fd = STDOUT_FILENO;
+  }
+  else if(exists && !S_ISREG(existing.st_mode)){
+    fd = ::open(path.c_str(), O_WRONLY);
+  }
+  else{
+    //through a symlink, the file it points to is replaced
+    char * real = exists ? ::realpath(path.c_str(), nullptr) : nullptr;
+    targetPath = real ? real : path;
+    std::free(real);
+    tempPath = targetPath + ".XXXXXX";
+    fd = ::mkstemp(tempPath.data());
+    if(fd >= 0){
+      mode_t mask = ::umask(0);
+      ::umask(mask);
+      ::fchmod(fd, exists ? existing.st_mode & 07777 : 0666 & ~mask);
+    }
+    else{
+      //a directory that can't be written to, but the file can
+      tempPath.clear();
+      fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+  }
+  if(fd < 0) throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+  struct stat info{};
+  seekable = ::fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+  if(seekable) blockOffset = ::lseek(fd, 0, SEEK_CUR);
+  block.reserve(2 * blockSize);
+}
+MidiSink::MidiSink(){
+  block.reserve(2 * blockSize);
+}
+MidiSink::~MidiSink(){
+  if(!tempPath.empty()) ::unlink(tempPath.c_str());
+  if(fd > STDERR_FILENO) ::close(fd);
+}
+size_t MidiSink::endChunk(){
+  off_t length = blockOffset + block.size() - chunkOffset - 8;
+  unsigned char bytes[4] = {
+    static_cast<unsigned char>((length & 0xff000000) >> 24),
+    static_cast<unsigned char>((length & 0x00ff0000) >> 16),
+    static_cast<unsigned char>((length & 0x0000ff00) >> 8),
+    static_cast<unsigned char>((length & 0x000000ff))};
+  if(chunkOffset >= blockOffset){
+    std::memcpy(block.data() + (chunkOffset - blockOffset) + 4, bytes, 4);
+  }
+  else if(::pwrite(fd, bytes, 4, chunkOffset + 4) != 4){
+    throw std::runtime_error(std::string("write failed: ") + std::strerror(errno));
+  }
+  chunkOffset = -1;
+  return length;
+}
+void MidiSink::write(const std::vector<unsigned char> & bytes){
+  if(bytes.size() < blockSize || fd < 0){
+    block.insert(block.end(), bytes.begin(), bytes.end());
+    flushIfFull();
+    return;
+  }
+  flush();
+  writeAll(bytes.data(), bytes.size());
+  blockOffset += bytes.size();
+}
+void MidiSink::finish(){
+  flush();
+  if(tempPath.empty()) return;
+  if(::rename(tempPath.c_str(), targetPath.c_str()) != 0)
+    throw std::runtime_error("cannot save " + targetPath + ": " + std::strerror(errno));
+  tempPath.clear();
+}
+
+
+EventList decodeEvents(const unsigned char * data, size_t size, NoteTable * notes){
+  EventList events{};
+  EventReader reader(data, size);
+  MidiEvent event{};
+  while(reader.next(event)){
+    if(!notes || notes->keep(event))
+      events.push_back(event);
+  }
+  events.endTick = reader.time();
+  if(notes){
+    notes->endAll([&](unsigned char status, unsigned char note){
+      events.push_back(events.endTick, status, note, 0);
+    });
+  }
+  return events;
+}
+
+//add the notes repaired in from to report
+static void addRepairs(TrackReport & report, const TrackReport & from){
+  report.notesMerged += from.notesMerged;
+  report.noteOffsDropped += from.noteOffsDropped;
+  report.notesEnded += from.notesEnded;
+}
+static void addRepairs(TrackReport & report, const NoteTable & notes){
+  report.notesMerged += notes.merged;
+  report.noteOffsDropped += notes.dropped;
+  report.notesEnded += notes.ended;
+}
+
+
+//bit i set if byte i of the 64 at p is 0x80 or above. the byte at a time
+//one is the reference the others are checked against (--verify).
+using HighBits = uint64_t (*)(const unsigned char *);
+static uint64_t highBitsBytes(const unsigned char * p){
+  uint64_t mask = 0;
+  for(unsigned i=0; i<64; i++)
+    mask |= uint64_t(p[i] >> 7) << i;
+  return mask;
+}
+static uint64_t highBitsWords(const unsigned char * p){
+  uint64_t mask = 0;
+  for(unsigned i=0; i<8; i++){
+    uint64_t word{};
+    std::memcpy(&word, p + 8 * i, 8);
+    if constexpr(std::endian::native == std::endian::big) word = __builtin_bswap64(word);
+    //gather the top bits of the 8 bytes into the top byte
+    mask |= (((word & 0x8080808080808080) * 0x0002040810204081) >> 56) << (8 * i);
+  }
+  return mask;
+}
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint64_t highBitsSse2(const unsigned char * p){
+  uint64_t mask = 0;
+  for(unsigned i=0; i<4; i++){
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+    mask |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(bytes))) << (16 * i);
+  }
+  return mask;
+}
+__attribute__((target("avx2")))
+static uint64_t highBitsAvx2(const unsigned char * p){
+  __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+  return uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(low)))
+       | uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(high))) << 32;
+}
+#endif
+//the kernels the cpu has, fastest first, the reference last
+static const std::vector<HighBits> highBitsKernels = []{
+  std::vector<HighBits> kernels{};
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) kernels.push_back(highBitsAvx2);
+  if(__builtin_cpu_supports("sse2")) kernels.push_back(highBitsSse2);
+#endif
+  kernels.push_back(highBitsWords);
+  kernels.push_back(highBitsBytes);
+  return kernels;
+}();
+static const HighBits highBits = highBitsKernels.front();
+
+//the high bits of a track, 128 bytes of them at a time, so that the bytes
+//of an event can be checked all at once with shifts and masks
+class HighBitWindow{
+
+const unsigned char * data{};
+size_t size{};
+HighBits highBits{};
+size_t base{};       //offset of the first byte of the window, a multiple of 64
+uint64_t low{};      //bytes [base, base + 64)
+uint64_t high{};     //bytes [base + 64, base + 128)
+
+  uint64_t block(size_t offset) const{
+    if(offset + 64 <= size) return highBits(data + offset);
+    //the end of the track, past it counts as clear
+    unsigned char tail[64]{};
+    if(offset < size) std::memcpy(tail, data + offset, size - offset);
+    return highBits(tail);
+  }
+
+public:
+  HighBitWindow(const unsigned char * data, size_t size, HighBits highBits)
+    : data(data), size(size), highBits(highBits){
+    low = block(0);
+    high = block(64);
+  }
+  //bit i set if byte offset + i is 0x80 or above
+  uint64_t at(size_t offset){
+    if(offset >= base + 128){
+      base = offset & ~size_t(63);
+      low = block(base);
+      high = block(base + 64);
+    }
+    else if(offset >= base + 64){
+      base += 64;
+      low = high;
+      high = block(base + 64);
+    }
+    unsigned shift = offset - base;
+    return shift ? low >> shift | high << (64 - shift) : low;
+  }
+};
+
+//validateTrack with the high bits of kernel. without fast, every event goes
+//through checkEvent: the reference the fast loop is checked against.
+static void validateTrackWith(const unsigned char * data, size_t size, HighBits kernel, bool fast){
+  auto fail = [](const std::string & message, size_t offset){
+    throw std::runtime_error(message + " at offset " + std::to_string(offset));
+  };
+  HighBitWindow window(data, size, kernel);
+  unsigned char status = 0;
+  size_t pos = 0;
+  //a variable length quantity at pos, pos moved past it
+  auto readLength = [&](uint64_t bits){
+    unsigned continued = std::countr_one(bits);
+    if(continued > 3) fail("variable length quantity longer than 4 bytes", pos);
+    if(pos + continued >= size) fail("truncated variable length quantity", pos);
+    unsigned length = 0;
+    for(unsigned i=0; i<=continued; i++)
+      length = length << 7 | (data[pos + i] & 0x7f);
+    pos += continued + 1;
+    return length;
+  };
+  //the event at pos, any kind, pos moved past it. true at the end of track.
+  auto checkEvent = [&]{
+    readLength(window.at(pos));
+    if(pos == size) fail("truncated event", pos);
+    uint64_t bits = window.at(pos);
+    if(bits & 1){
+      unsigned char first = data[pos];
+      if(first == 0xff || first == 0xf0 || first == 0xf7){
+        size_t start = pos++;
+        status = 0;
+        unsigned char type = 0;
+        if(first == 0xff){
+          if(pos == size) fail("truncated meta event", start);
+          if(bits & 2) fail("meta event type above 0x7F", pos);
+          type = data[pos++];
+        }
+        if(pos == size) fail("truncated event length", pos);
+        size_t length = readLength(window.at(pos));
+        if(length > size - pos) fail("event longer than the track", start);
+        pos += length;
+        if(first == 0xff && type == 0x2f){
+          if(pos != size) fail("events after the end of track", pos);
+          return true;
+        }
+        return false;
+      }
+      if(first > 0xef) fail("system message in a track", pos);
+      status = first;
+      pos++;
+      bits >>= 1;
+    }
+    else if(!status){
+      fail("data byte without a status", pos);
+    }
+    unsigned dataBytes = hasData2(status) ? 2 : 1;
+    if(size - pos < dataBytes) fail("truncated event", pos);
+    if(bits & ((1u << dataBytes) - 1))
+      fail("data byte above 0x7F", pos + std::countr_zero(bits));
+    pos += dataBytes;
+    return false;
+  };
+
+  while(pos < size){
+    //channel events (at most 7 bytes) are checked from the high bits alone,
+    //64 bytes of them at a time. anything else, errors included, goes
+    //through checkEvent. kept in locals, the lambdas would otherwise pin
+    //them to memory.
+    size_t start = pos, at = pos;
+    uint64_t bits = window.at(at);
+    unsigned char running = status;
+    while(fast && at + 8 <= size){
+      if(at - start > 56){
+        start = at;
+        bits = window.at(at);
+      }
+      //branch free but for the way out, event shapes are hard to predict
+      uint64_t eventBits = bits >> (at - start);
+      unsigned length = std::countr_one(eventBits) + 1;
+      if(length > 4) break;
+      unsigned isStatus = eventBits >> length & 1;
+      unsigned char eventStatus = isStatus ? data[at + length] : running;
+      unsigned dataBytes = hasData2(eventStatus) ? 2 : 1;
+      length += isStatus;
+      //no status yet, or a system message
+      if(((unsigned char)(eventStatus - 0x80) >= 0x70) | (eventBits >> length & ((1u << dataBytes) - 1)))
+        break;
+      running = eventStatus;
+      at += length + dataBytes;
+    }
+    pos = at;
+    status = running;
+    if(pos < size && checkEvent()) return;
+  }
+  fail("missing end of track", size);
+}
+void validateTrack(const unsigned char * data, size_t size){
+  validateTrackWith(data, size, highBits, true);
+}
+
+//the message validating with kernel throws, empty if none
+static std::string validationError(const unsigned char * data, size_t size, HighBits kernel, bool fast){
+  try{
+    validateTrackWith(data, size, kernel, fast);
+  }
+  catch(const std::runtime_error & e){
+    return e.what();
+  }
+  return {};
+}
+//every high bits kernel the cpu has against the reference, on every block
+//of a track chunk body, and validateTrack with each of them against the
+//reference validation. throws std::logic_error if any disagree.
+static void crossCheckValidation(const unsigned char * data, size_t size){
+  for(size_t offset=0; offset<size; offset+=64){
+    unsigned char block[64]{};
+    std::memcpy(block, data + offset, std::min<size_t>(64, size - offset));
+    uint64_t expected = highBitsBytes(block);
+    for(HighBits kernel: highBitsKernels){
+      if(kernel(block) != expected)
+        throw std::logic_error("high bits kernels disagree at offset " + std::to_string(offset));
+    }
+  }
+  std::string expected = validationError(data, size, highBitsBytes, false);
+  for(HighBits kernel: highBitsKernels){
+    if(validationError(data, size, kernel, true) != expected)
+      throw std::logic_error("validateTrack disagrees with the reference: " + (expected.empty() ? "valid" : expected));
+  }
+}
+
+
+//the transform kernels. the scalar ones are the reference, the AVX2 ones
+//do the same 32 notes, 16 velocities or 4 ticks at a time, the rest of
+//the events through the scalar ones.
+
+//notes of note offs, note ons and key pressures plus semitones, within 0-127
+static void transposeScalar(const unsigned char * statuses, unsigned char * notes, size_t count, int semitones){
+  for(size_t i=0; i<count; i++){
+    unsigned kind = statuses[i] >> 4;
+    if(kind >= 0x8 && kind <= 0xa)
+      notes[i] = std::clamp(std::min<int>(notes[i], 127) + semitones, 0, 127);
+  }
+}
+//velocities of note ons times scale / 256, rounded, within 1-127
+static void scaleVelocitiesScalar(const unsigned char * statuses, unsigned char * velocities, size_t count,
+                                  unsigned scale){
+  for(size_t i=0; i<count; i++){
+    if((statuses[i] & 0xf0) == 0x90 && velocities[i])
+      velocities[i] = std::clamp<unsigned>((velocities[i] * scale + 128) >> 8, 1, 127);
+  }
+}
+//ticks times multiplier / divisor, rounded to the nearest, times step.
+//multiplier is at most 0xFFFF, so that every value is exact in a double.
+static unsigned scaleTick(unsigned tick, unsigned multiplier, unsigned divisor, unsigned step){
+  uint64_t scaled = (uint64_t(tick) * multiplier + divisor / 2) / divisor * step;
+  return std::min<uint64_t>(scaled, std::numeric_limits<unsigned>::max());
+}
+static void scaleTicksScalar(unsigned * ticks, size_t count, unsigned multiplier, unsigned divisor, unsigned step){
+  for(size_t i=0; i<count; i++)
+    ticks[i] = scaleTick(ticks[i], multiplier, divisor, step);
+}
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void transposeAvx2(const unsigned char * statuses, unsigned char * notes, size_t count, int semitones){
+  //notes are at most 127, signed saturation keeps them above -128
+  const __m256i add = _mm256_set1_epi8(std::clamp(semitones, -127, 127));
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  const __m256i max = _mm256_set1_epi8(127);
+  size_t i = 0;
+  for(; i + 32 <= count; i += 32){
+    __m256i status = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(statuses + i));
+    __m256i note = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(notes + i));
+    __m256i kind = _mm256_and_si256(_mm256_srli_epi16(status, 4), low);
+    __m256i isNote = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(kind, _mm256_set1_epi8(0x8)),
+                                                     _mm256_cmpeq_epi8(kind, _mm256_set1_epi8(0x9))),
+                                     _mm256_cmpeq_epi8(kind, _mm256_set1_epi8(0xa)));
+    __m256i moved = _mm256_max_epi8(_mm256_adds_epi8(_mm256_min_epu8(note, max), add), _mm256_setzero_si256());
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(notes + i), _mm256_blendv_epi8(note, moved, isNote));
+  }
+  transposeScalar(statuses + i, notes + i, count - i, semitones);
+}
+__attribute__((target("avx2")))
+static void scaleVelocitiesAvx2(const unsigned char * statuses, unsigned char * velocities, size_t count,
+                                unsigned scale){
+  const __m256i factor = _mm256_set1_epi16(static_cast<short>(scale));
+  const __m256i one = _mm256_set1_epi16(1);
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16){
+    __m256i status = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(statuses + i)));
+    __m256i velocity = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(velocities + i)));
+    __m256i isNoteOn = _mm256_andnot_si256(_mm256_cmpeq_epi16(velocity, _mm256_setzero_si256()),
+      _mm256_cmpeq_epi16(_mm256_and_si256(status, _mm256_set1_epi16(0xf0)), _mm256_set1_epi16(0x90)));
+    //velocity * scale is at most 23 bits: bits 8-22 from the two halves,
+    //plus bit 7 to round
+    __m256i productLow = _mm256_mullo_epi16(velocity, factor);
+    __m256i productHigh = _mm256_mulhi_epu16(velocity, factor);
+    __m256i scaled = _mm256_or_si256(_mm256_slli_epi16(productHigh, 8), _mm256_srli_epi16(productLow, 8));
+    scaled = _mm256_add_epi16(scaled, _mm256_and_si256(_mm256_srli_epi16(productLow, 7), one));
+    scaled = _mm256_max_epu16(_mm256_min_epu16(scaled, _mm256_set1_epi16(127)), one);
+    __m256i result = _mm256_blendv_epi8(velocity, scaled, isNoteOn);
+    result = _mm256_permute4x64_epi64(_mm256_packus_epi16(result, result), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(velocities + i), _mm256_castsi256_si128(result));
+  }
+  scaleVelocitiesScalar(statuses + i, velocities + i, count - i, scale);
+}
+__attribute__((target("avx2")))
+static void scaleTicksAvx2(unsigned * ticks, size_t count, unsigned multiplier, unsigned divisor, unsigned step){
+  //in doubles: tick * multiplier + divisor / 2 is below 2^49, so exact. the
+  //quotient from the reciprocal is off by at most one, the remainder fixes it.
+  const __m256d scale = _mm256_set1_pd(multiplier);
+  const __m256d half = _mm256_set1_pd(divisor / 2);
+  const __m256d d = _mm256_set1_pd(divisor);
+  const __m256d reciprocal = _mm256_set1_pd(1.0 / divisor);
+  const __m256d s = _mm256_set1_pd(step);
+  const __m256d one = _mm256_set1_pd(1);
+  const __m256d bias = _mm256_set1_pd(2147483648.0);
+  const __m256d max = _mm256_set1_pd(4294967295.0);
+  const __m128i sign = _mm_set1_epi32(INT32_MIN);
+  size_t i = 0;
+  for(; i + 4 <= count; i += 4){
+    //unsigned to double and back through the signed conversions, offset by 2^31
+    __m128i tick = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ticks + i));
+    __m256d t = _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(tick, sign)), bias);
+    __m256d n = _mm256_add_pd(_mm256_mul_pd(t, scale), half);
+    __m256d q = _mm256_floor_pd(_mm256_mul_pd(n, reciprocal));
+    __m256d r = _mm256_sub_pd(n, _mm256_mul_pd(q, d));
+    q = _mm256_sub_pd(q, _mm256_and_pd(_mm256_cmp_pd(r, _mm256_setzero_pd(), _CMP_LT_OQ), one));
+    q = _mm256_add_pd(q, _mm256_and_pd(_mm256_cmp_pd(r, d, _CMP_GE_OQ), one));
+    __m256d result = _mm256_min_pd(_mm256_mul_pd(q, s), max);
+    __m128i scaled = _mm_xor_si128(_mm256_cvttpd_epi32(_mm256_sub_pd(result, bias)), sign);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(ticks + i), scaled);
+  }
+  scaleTicksScalar(ticks + i, count - i, multiplier, divisor, step);
+}
+#endif
+struct TransformKernels{
+  void (*transpose)(const unsigned char *, unsigned char *, size_t, int);
+  void (*scaleVelocities)(const unsigned char *, unsigned char *, size_t, unsigned);
+  void (*scaleTicks)(unsigned *, size_t, unsigned, unsigned, unsigned);
+};
+static const TransformKernels scalarTransformKernels{transposeScalar, scaleVelocitiesScalar, scaleTicksScalar};
+static const TransformKernels transformKernels = []{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return TransformKernels{transposeAvx2, scaleVelocitiesAvx2, scaleTicksAvx2};
+#endif
+  return scalarTransformKernels;
+}();
+
+//a tick stretched, then quantized, as transformEvents does
+static unsigned transformTick(unsigned tick, const EventTransform & transform){
+  if(transform.stretches()) tick = scaleTick(tick, transform.toDivision, transform.fromDivision, 1);
+  if(transform.grid > 1) tick = scaleTick(tick, 1, transform.grid, transform.grid);
+  return tick;
+}
+
+static void transformWith(EventList & events, const EventTransform & transform, const TransformKernels & kernels){
+  if(!events.patterns.empty())
+    throw std::logic_error("the patterns of a track are expanded before it is transformed");
+  size_t count = events.size();
+  if(transform.transpose){
+    int semitones = std::clamp(transform.transpose, -127, 127);
+    kernels.transpose(events.statuses.data(), events.data1.data(), count, semitones);
+  }
+  if(transform.velocityScale != 1){
+    //in 256ths, more than 0xFFFF would put every velocity at 127 anyway
+    double scale = std::clamp(transform.velocityScale, 0.0, 255.0);
+    kernels.scaleVelocities(events.statuses.data(), events.data2.data(), count, std::lround(scale * 256));
+  }
+  if(transform.stretches())
+    kernels.scaleTicks(events.ticks.data(), count, transform.toDivision, transform.fromDivision, 1);
+  if(transform.grid > 1)
+    kernels.scaleTicks(events.ticks.data(), count, 1, transform.grid, transform.grid);
+  events.endTick = transformTick(events.endTick, transform);
+}
+void transformEvents(EventList & events, const EventTransform & transform){
+  transformWith(events, transform, transformKernels);
+}
+//the transform of options, if any. with --verify the events are also
+//transformed by the scalar kernels, and std::logic_error is thrown if the
+//vectorized ones give anything else.
+static void transformTrack(EventList & events, const BuildOptions & options){
+  if(!options.transform.active()) return;
+  if(!options.verify){
+    transformEvents(events, options.transform);
+    return;
+  }
+  EventList expected = events;
+  transformWith(expected, options.transform, scalarTransformKernels);
+  transformEvents(events, options.transform);
+  if(events != expected)
+    throw std::logic_error("the transform kernels disagree with the scalar ones");
+}
+
+
+MidiFileReader::MidiFileReader(const std::string & path){
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0) throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+  struct stat info{};
+  if(::fstat(fd, &info) != 0 || info.st_size < 14){
+    ::close(fd);
+    throw std::runtime_error(path + " is not a midi file");
+  }
+  size = info.st_size;
+  void * map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if(map == MAP_FAILED) throw std::runtime_error("cannot map " + path + ": " + std::strerror(errno));
+  ::madvise(map, size, MADV_SEQUENTIAL);
+  data = static_cast<const unsigned char *>(map);
+
+  if(std::memcmp(data, "MThd", 4) != 0 || bigEndian(data + 4, 4) < 6){
+    ::munmap(map, size);
+    throw std::runtime_error(path + " is not a midi file");
+  }
+  fileType = bigEndian(data + 8, 2);
+  numberOfTracks = bigEndian(data + 10, 2);
+  divisionTime = bigEndian(data + 12, 2);
+
+  //chunks other than MTrk are skipped, a truncated last chunk is cut short
+  size_t offset = 8 + bigEndian(data + 4, 4);
+  while(offset + 8 <= size){
+    size_t length = std::min<size_t>(bigEndian(data + offset + 4, 4), size - offset - 8);
+    if(std::memcmp(data + offset, "MTrk", 4) == 0)
+      trackChunks.push_back(Chunk{data + offset + 8, length});
+    offset += 8 + length;
+  }
+}
+MidiFileReader::~MidiFileReader(){
+  ::munmap(const_cast<unsigned char *>(data), size);
+}
+
+
+MidiBuilder::MidiBuilder(MidiSink & sink, const BuildOptions & options)
+  : sink(sink), options(options){
+}
+BuildOptions MidiBuilder::optionsFor(const BuildOptions & options, unsigned short & divisionTime){
+  BuildOptions stretched = options;
+  if(stretched.transform.toDivision){
+    if(!stretched.transform.fromDivision) stretched.transform.fromDivision = divisionTime;
+    divisionTime = stretched.transform.toDivision;
+  }
+  return stretched;
+}
+void MidiBuilder::write(const Song & song){
+  if(song.tracks.size() > std::numeric_limits<unsigned short>::max())
+    throw std::runtime_error("more tracks than a midi file can hold");
+  fileType = song.fileType;
+  numberOfTracks = song.tracks.size();
+  divisionTime = song.divisionTime;
+  const BuildOptions songOptions = optionsFor(options, divisionTime);
+  const std::vector<Track> & tracks = song.tracks;
+  if(!options.cacheDirectory.empty() && ::mkdir(options.cacheDirectory.c_str(), 0777) != 0 && errno != EEXIST)
+    throw std::runtime_error("cannot create " + options.cacheDirectory + ": " + std::strerror(errno));
+  if(options.flatten || (fileType == 0 && tracks.size() > 1)){
+    //the tracks are encoded, then merged, and transformed as they are merged
+    BuildOptions trackOptions = songOptions;
+    trackOptions.verify = false;
+    trackOptions.transform = {};
+    std::vector<std::vector<unsigned char>> buffers(tracks.size());
+    std::vector<MidiFileReader::Chunk> chunks{};
+    TrackReport repaired{};
+    for(size_t i=0; i<tracks.size(); i++){
+      addRepairs(repaired, cachedTrack(tracks[i], i, buffers[i], nullptr, trackOptions, song.patterns));
+      chunks.push_back(MidiFileReader::Chunk{buffers[i].data() + 8, buffers[i].size() - 8});
+    }
+    writeFlattened(chunks, songOptions);
+    addRepairs(reports[0], repaired);
+    return;
+  }
+  buildMidiHeader();
+  buildTracks(tracks.size(), [&song, &songOptions](size_t i, std::vector<unsigned char> & trackBuffer, MidiSink * streamTo){
+    return cachedTrack(song.tracks[i], i, trackBuffer, streamTo, songOptions, song.patterns);
+  });
+}
+void MidiBuilder::write(const MidiFileReader & file){
+  fileType = file.fileType;
+  numberOfTracks = file.trackChunks.size();
+  divisionTime = file.divisionTime;
+  const BuildOptions fileOptions = optionsFor(options, divisionTime);
+  if(options.flatten){
+    writeFlattened(file.trackChunks, fileOptions);
+    return;
+  }
+  buildMidiHeader();
+  buildTracks(file.trackChunks.size(), [&file, &fileOptions](size_t i, std::vector<unsigned char> & trackBuffer, MidiSink * streamTo){
+    const auto & chunk = file.trackChunks[i];
+    NoteTable notes{};
+    EventList events = decodeEvents(chunk.data, chunk.size, fileOptions.repairNotes ? &notes : nullptr);
+    transformTrack(events, fileOptions);
+    TrackReport report = writeTrack(events, trackBuffer, streamTo, fileOptions);
+    addRepairs(report, notes);
+    return report;
+  });
+}
+void MidiBuilder::writeFlattened(const std::vector<MidiFileReader::Chunk> & chunks, const BuildOptions & options){
+  if(fileType == 2)
+    throw std::runtime_error("the tracks of a type 2 file are separate sequences, they can't be flattened");
+  fileType = 0;
+  numberOfTracks = 1;
+  buildMidiHeader();
+  reports.assign(1, mergeTracks(chunks, sink, options));
+}
+void MidiBuilder::buildMidiHeader(){
+  std::vector<unsigned char> & midiBuffer = sink.buffer();
+  const auto header = midiHeader(fileType, numberOfTracks, divisionTime);
+  midiBuffer.insert(midiBuffer.end(), header.begin(), header.end());
+}
+template<typename Encode>
+void MidiBuilder::buildTracks(size_t count, Encode encode){
+  reports.assign(count, TrackReport{});
+  if((options.jobs < 2 || count < 2) && !options.verify && !options.validate){
+    for(size_t i=0; i<count; i++)
+      reports[i] = encode(i, sink.buffer(), &sink);
+    return;
+  }
+
+  //every track only depends on its own events, so workers encode them
+  //each into its own buffer, and the buffers are written in track order
+  //as soon as they are ready
+  std::vector<std::vector<unsigned char>> buffers(count);
+  std::vector<std::exception_ptr> errors(count);
+  std::vector<char> done(count);
+  std::mutex mutex{};
+  std::condition_variable ready{};
+  std::atomic<size_t> next{0};
+  auto worker = [&]{
+    for(size_t i; (i = next++) < count;){
+      try{
+        reports[i] = encode(i, buffers[i], nullptr);
+      }
+      catch(const std::exception & e){
+        errors[i] = std::make_exception_ptr(
+          std::runtime_error("track " + std::to_string(i) + ": " + e.what()));
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        done[i] = true;
+      }
+      ready.notify_all();
+    }
+  };
+  std::vector<std::jthread> workers{};
+  for(unsigned j=0; j<options.jobs && j<count; j++)
+    workers.emplace_back(worker);
+
+  for(size_t i=0; i<count; i++){
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready.wait(lock, [&]{ return done[i] != 0; });
+    }
+    if(errors[i]){
+      next = count;
+      std::rethrow_exception(errors[i]);
+    }
+    sink.write(buffers[i]);
+    std::vector<unsigned char>().swap(buffers[i]);
+  }
+}
+size_t MidiBuilder::eventCount(const Track & track){
+  size_t count = 0;
+  for(const auto & event: track.events){
+    switch(event.kind){
+      case 1: case 2: case 3: case 4: case 5: count += 2 * size_t(event.noteCount);break;
+      case 7: count += event.times;break;
+      case 9: count += event.noteCount ? 2 * size_t(event.number) : 0;break;
+      case 10: case 11: case 13: count++;break;
+      case 20: case 21: case 22: case 23: count += 1 + std::max(event.steps, 0);break;
+      default: ;
+    }
+  }
+  return count;
+}
+TrackReport MidiBuilder::buildTrack(const Track & track, size_t index, std::vector<unsigned char> & trackBuffer,
+                                    MidiSink * streamTo, const BuildOptions & options,
+                                    std::span<const Track> patterns){
+  TrackReport built{};
+  TrackStats & stats = built.stats;
+  std::chrono::steady_clock::time_point start{};
+  if constexpr(collectStats) start = std::chrono::steady_clock::now();
+
+  //streamed, the events are encoded a batch at a time as they are built
+  EventBatches batches = buildBatches(track, index, options, patterns, true,
+                                      streamTo ? streamBatchEvents : std::numeric_limits<size_t>::max(), &built);
+  TrackReport report{};
+  if(streamTo){
+    report = streamTrack(batches, trackBuffer, *streamTo, options);
+    if constexpr(collectStats){
+      stats.buildSeconds = report.stats.buildSeconds;
+      stats.encodeSeconds = report.stats.encodeSeconds;
+    }
+  }
+  else{
+    batches.next();
+    std::chrono::steady_clock::time_point builtAt{};
+    if constexpr(collectStats) builtAt = std::chrono::steady_clock::now();
+    report = writeTrack(batches.batch(), trackBuffer, nullptr, options);
+    if constexpr(collectStats){
+      stats.buildSeconds = std::chrono::duration<double>(builtAt - start).count();
+      stats.encodeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - builtAt).count();
+    }
+  }
+  addRepairs(report, built);
+  if constexpr(collectStats){
+    stats.reallocations += report.stats.reallocations;
+    report.stats = stats;
+  }
+  return report;
+}
+EventBatches MidiBuilder::buildBatches(const Track & track, size_t index, BuildOptions options,
+                                       std::span<const Track> patterns, bool copyPatterns, size_t batchEvents,
+                                       TrackReport * report){
+  TrackStats * stats = report ? &report->stats : nullptr;
+  unsigned char channelNumber{0}; //0-15
+  Random random(options.seed, index);
+  //by pattern number and channel, they live until the track is built. left
+  //not encoded, repeats are built as events.
+  std::unordered_map<size_t, EncodedPattern> encodedPatterns{};
+  //transformed events can't be copied as the bytes encoded before
+  copyPatterns = copyPatterns && !options.transform.active();
+
+  NoteTable notes{};
+  //events, at absolute ticks. a batch is done after a script event, or
+  //after a time a pattern is played.
+  TrackScheduler scheduler(std::min(eventCount(track), batchEvents), options.repairNotes ? &notes : nullptr);
+  for(const auto & event: track.events){
+    size_t before = scheduler.events.size();
+    unsigned times = 1;
+    const EncodedPattern * encoded{};
+    if(event.kind == 7){
+      if(event.number >= patterns.size())
+        throw std::runtime_error("pattern " + std::to_string(event.number) + " is not defined");
+      auto [entry, added] = encodedPatterns.try_emplace(size_t(event.number) << 4 | channelNumber);
+      if(added && copyPatterns) encodePattern(patterns[event.number], channelNumber, entry->second, options);
+      encoded = &entry->second;
+      times = event.times;
+      scheduler.cursor += event.deltaTime;
+    }
+    for(unsigned i=0; i<times; i++){
+      size_t copiesBefore = scheduler.events.patterns.size();
+      if(encoded){
+        playPattern(scheduler, channelNumber, patterns[event.number], *encoded, random);
+      }
+      else{
+        buildEvent(scheduler, channelNumber, event, track.notes(event), random);
+        if constexpr(collectStats) if(stats) countEvent(*stats, event, scheduler.events.size() - before);
+      }
+      if constexpr(collectStats) if(stats && encoded){
+        size_t copies = scheduler.events.patterns.size() - copiesBefore;
+        stats->patternCopies += copies;
+        stats->patternEvents += scheduler.events.size() - before + copies * (encoded->events.size() - 1);
+      }
+      if(scheduler.events.size() >= batchEvents){
+        transformTrack(scheduler.events, options);
+        co_yield scheduler.events;
+        scheduler.events.clear();
+      }
+      before = scheduler.events.size();
+    }
+  }
+  scheduler.finish();
+  transformTrack(scheduler.events, options);
+  if(report) addRepairs(*report, notes);
+  if constexpr(collectStats) if(stats) stats->reallocations += scheduler.reallocations;
+  co_yield scheduler.events;
+}
+//a cache entry: the counts of the report, then the hash of the chunk (64
+//bits, little endian each), then the track chunk
+constexpr size_t cacheCounts = 5;
+constexpr size_t cacheHashWords = 2;
+constexpr size_t cacheHeaderSize = 8 * (cacheCounts + cacheHashWords);
+//part of every key, bump it when the encoding of a track changes
+constexpr uint64_t trackCacheVersion = 3;
+
+//the counts of report kept in a cache entry, in order
+static std::array<size_t *, cacheCounts> cachedCounts(TrackReport & report){
+  return {&report.events, &report.statusesLeftOut, &report.notesMerged, &report.noteOffsDropped, &report.notesEnded};
+}
+
+//two multiply-xorshift lanes over 8 byte words, 128 bits so that the keys
+//of a cache of any size don't collide by chance. not meant to resist
+//collisions made on purpose.
+class ContentHash{
+
+uint64_t a{0x243f6a8885a308d3};
+uint64_t b{0x13198a2e03707344};
+
+  void word(uint64_t w){
+    a = (a ^ w) * 0x9e3779b97f4a7c15;
+    a ^= a >> 32;
+    b = std::rotl(b ^ w, 23) * 0xbf58476d1ce4e5b9;
+    b ^= b >> 29;
+  }
+
+public:
+  void add(uint64_t value){
+    word(value);
+  }
+  //the size goes in first, so that fields can't shift into each other
+  void add(const void * data, size_t size){
+    const unsigned char * p = static_cast<const unsigned char *>(data);
+    word(size);
+    for(; size >= 8; p += 8, size -= 8){
+      uint64_t w{};
+      std::memcpy(&w, p, 8);
+      word(w);
+    }
+    if(size){
+      uint64_t w{};
+      std::memcpy(&w, p, size);
+      word(w);
+    }
+  }
+  std::array<uint64_t, 2> digest() const{
+    uint64_t x = a ^ std::rotl(b, 32), y = b + a * 0x94d049bb133111eb;
+    x = (x ^ (x >> 31)) * 0xd6e8feb86659fd93;
+    y = (y ^ (y >> 29)) * 0xbf58476d1ce4e5b9;
+    return {x ^ x >> 32, y ^ y >> 32};
+  }
+  std::string hex() const{
+    auto [x, y] = digest();
+    char digits[33]{};
+    std::snprintf(digits, sizeof(digits), "%016llx%016llx", (unsigned long long)x, (unsigned long long)y);
+    return digits;
+  }
+};
+
+//what a cache entry keeps of its chunk, to tell it from a damaged one
+static std::array<uint64_t, cacheHashWords> chunkHash(const unsigned char * chunk, size_t size){
+  ContentHash hash{};
+  hash.add(chunk, size);
+  return hash.digest();
+}
+
+static bool drawsRandom(const Track & track){
+  return std::any_of(track.events.begin(), track.events.end(), [](const TrackEvent & event){
+    return event.kind == 9 && event.arpMode == 1 && event.noteCount;
+  });
+}
+
+//what the chunk of a track depends on. every track starts on channel 0
+//with no program, so its state is in its events, and in the patterns it
+//repeats. the seed and the track number only matter to random notes.
+static std::string trackKey(const Track & track, size_t index, const BuildOptions & options,
+                            std::span<const Track> patterns){
+  static_assert(std::has_unique_object_representations_v<TrackEvent>, "track events are hashed as bytes");
+  ContentHash hash{};
+  hash.add(trackCacheVersion);
+  hash.add(options.runningStatus);
+  hash.add(options.repairNotes);
+  const EventTransform & transform = options.transform;
+  if(transform.active()){
+    hash.add(static_cast<int64_t>(transform.transpose));
+    hash.add(std::bit_cast<uint64_t>(transform.velocityScale));
+    hash.add(transform.stretches() ? uint64_t(transform.fromDivision) << 16 | transform.toDivision : 0);
+    hash.add(transform.grid);
+  }
+  auto addTrack = [&hash](const Track & hashed){
+    hash.add(hashed.events.data(), hashed.events.size() * sizeof(TrackEvent));
+    hash.add(hashed.noteNumbers.data(), hashed.noteNumbers.size());
+  };
+  addTrack(track);
+  bool random = drawsRandom(track);
+  std::vector<char> added(patterns.size());
+  for(const auto & event: track.events){
+    if(event.kind != 7 || event.number >= patterns.size() || added[event.number]) continue;
+    added[event.number] = true;
+    hash.add(event.number);
+    addTrack(patterns[event.number]);
+    random = random || drawsRandom(patterns[event.number]);
+  }
+  if(random){
+    hash.add(options.seed);
+    hash.add(index);
+  }
+  return hash.hex();
+}
+
+//append the chunk of the cache entry at path to buffer. false, with buffer
+//as it was, if there is none, its chunk isn't the one it was written with,
+//or it doesn't hold a valid track chunk.
+static bool readCacheEntry(const std::string & path, std::vector<unsigned char> & buffer, TrackReport & report){
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+  struct stat info{};
+  size_t start = buffer.size();
+  bool valid = ::fstat(fd, &info) == 0 && size_t(info.st_size) >= cacheHeaderSize + 8;
+  if(valid){
+    buffer.resize(start + info.st_size);
+    for(size_t done = 0; valid && done < size_t(info.st_size);){
+      ssize_t n = ::read(fd, buffer.data() + start + done, info.st_size - done);
+      if(n < 0 && errno == EINTR) continue;
+      valid = n > 0;
+      done += valid ? n : 0;
+    }
+  }
+  ::close(fd);
+  const unsigned char * entry = buffer.data() + start;
+  size_t chunkSize = valid ? info.st_size - cacheHeaderSize : 0;
+  const unsigned char * chunk = entry + cacheHeaderSize;
+  std::array<uint64_t, cacheCounts + cacheHashWords> header{};
+  for(unsigned i=0; valid && i<cacheHeaderSize; i++)
+    header[i / 8] |= uint64_t(entry[i]) << (8 * (i % 8));
+  valid = valid && std::memcmp(chunk, "MTrk", 4) == 0
+       && (size_t(chunk[4]) << 24 | chunk[5] << 16 | chunk[6] << 8 | chunk[7]) == chunkSize - 8
+       && std::equal(header.begin() + cacheCounts, header.end(), chunkHash(chunk, chunkSize).begin());
+  if(valid){
+    try{
+      validateTrack(chunk + 8, chunkSize - 8);
+    }
+    catch(const std::runtime_error &){
+      valid = false;
+    }
+  }
+  if(!valid){
+    buffer.resize(start);
+    return false;
+  }
+  auto counts = cachedCounts(report);
+  for(unsigned i=0; i<cacheCounts; i++)
+    *counts[i] = header[i];
+  report.bytes = chunkSize;
+  std::memmove(buffer.data() + start, chunk, chunkSize);
+  buffer.resize(start + chunkSize);
+  return true;
+}
+
+//false, with errno set, if not all of data could be written
+static bool writeFully(int fd, const unsigned char * data, size_t size){
+  while(size){
+    ssize_t n = ::write(fd, data, size);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0){
+      if(n == 0) errno = EIO;
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+//write the cache entry to a temporary file renamed to path, so that readers
+//(and builds running at the same time) never see a partial one
+static void writeCacheEntry(const std::string & path, const unsigned char * chunk, size_t size,
+                            TrackReport report){
+  std::array<uint64_t, cacheCounts + cacheHashWords> words{};
+  auto counts = cachedCounts(report);
+  for(unsigned i=0; i<cacheCounts; i++)
+    words[i] = *counts[i];
+  auto hash = chunkHash(chunk, size);
+  std::copy(hash.begin(), hash.end(), words.begin() + cacheCounts);
+  unsigned char header[cacheHeaderSize]{};
+  for(unsigned i=0; i<cacheHeaderSize; i++)
+    header[i] = words[i / 8] >> (8 * (i % 8));
+  std::string tempPath = path + ".XXXXXX";
+  int fd = ::mkstemp(tempPath.data());
+  if(fd < 0) throw std::runtime_error("cannot create " + tempPath + ": " + std::strerror(errno));
+  int error = 0;
+  if(!writeFully(fd, header, cacheHeaderSize) || !writeFully(fd, chunk, size)) error = errno;
+  if(::close(fd) != 0 && !error) error = errno;
+  if(!error && ::rename(tempPath.c_str(), path.c_str()) != 0) error = errno;
+  if(error){
+    ::unlink(tempPath.c_str());
+    throw std::runtime_error("cannot write " + path + ": " + std::strerror(error));
+  }
+}
+
+TrackReport MidiBuilder::cachedTrack(const Track & track, size_t index, std::vector<unsigned char> & trackBuffer,
+                                     MidiSink * streamTo, const BuildOptions & options,
+                                     std::span<const Track> patterns){
+  if(options.cacheDirectory.empty())
+    return buildTrack(track, index, trackBuffer, streamTo, options, patterns);
+  std::string path = options.cacheDirectory + "/" + trackKey(track, index, options, patterns) + ".mtrk";
+  TrackReport report{};
+  if(readCacheEntry(path, trackBuffer, report)){
+    report.cached = true;
+  }
+  else{
+    //encoded whole, it is written to the cache before it is streamed
+    size_t chunkStart = trackBuffer.size();
+    report = buildTrack(track, index, trackBuffer, nullptr, options, patterns);
+    writeCacheEntry(path, trackBuffer.data() + chunkStart, trackBuffer.size() - chunkStart, report);
+  }
+  if(streamTo) streamTo->flushIfFull();
+  return report;
+}
+void MidiBuilder::countEvent(TrackStats & stats, const TrackEvent & event, size_t added){
+  switch(event.kind){
+    case 1: case 2: case 3: case 4: case 5: stats.notes += event.noteCount;break;
+    case 9: stats.arpeggioNotes += event.noteCount ? event.number : 0;break;
+    case 10: stats.programChanges++;break;
+    case 11: stats.controlChanges++;break;
+    case 13: stats.pitchWheelChanges++;break;
+    case 20: case 21: case 22: case 23: stats.rampSteps += added;break;
+    default: ;
+  }
+}
+void MidiBuilder::buildEvent(TrackScheduler & track, unsigned char & channelNumber, const TrackEvent & event,
+                             std::span<const unsigned char> noteNumbers, Random & random){
+  switch(event.kind){
+    case 1: case 2: case 3: case 4: buildNotes(track, channelNumber, event, noteNumbers);break;
+    case 5: holdNotes(track, channelNumber, event, noteNumbers);break;
+    case 6: track.cursor += event.deltaTime;break;
+    case 9: arpeggio(track, channelNumber, event, noteNumbers, random);break;
+    case 10: programChange(track, channelNumber, event);break;
+    case 11: controlChange(track, channelNumber, event);break;
+    case 12:
+      //events pushed to Track::events directly skip the checks of Track::channel
+      if(event.number > 15) throw std::out_of_range("channel number above 15");
+      channelNumber = event.number;
+      break;
+    case 13: pitchWheelChange(track, channelNumber, event);break;
+    case 20: case 22: rampControlChange(track, channelNumber, event);break;
+    case 21: case 23: rampPitchWheelChange(track, channelNumber, event);break;
+    default: ;
+  }
+}
+void MidiBuilder::playPattern(TrackScheduler & track, unsigned char channelNumber, const Track & pattern,
+                              const EncodedPattern & encoded, Random & random){
+  if(encoded.copied && track.addPattern(track.cursor + encoded.events.ticks.front(), encoded)){
+    track.cursor += encoded.events.endTick;
+    return;
+  }
+  //held notes of earlier events end inside the pattern, or it draws
+  //random notes: built like any other events
+  for(const auto & patternEvent: pattern.events)
+    buildEvent(track, channelNumber, patternEvent, pattern.notes(patternEvent), random);
+}
+void MidiBuilder::encodePattern(const Track & pattern, unsigned char channelNumber, EncodedPattern & encoded,
+                                const BuildOptions & options){
+  for(const auto & event: pattern.events){
+    if(event.kind == 9 && event.arpMode == 1 && event.noteCount) return;
+  }
+  //a pattern with notes repaired is built every time, so that the notes
+  //sounding before it are taken into account and the repairs are counted
+  NoteTable notes{};
+  TrackScheduler scheduler(eventCount(pattern), options.repairNotes ? &notes : nullptr);
+  Random unused(0, 0);
+  for(const auto & event: pattern.events)
+    buildEvent(scheduler, channelNumber, event, pattern.notes(event), unused);
+  scheduler.finish();
+  if(notes.repaired()) return;
+  encoded.events = std::move(scheduler.events);
+  const EventList & events = encoded.events;
+  if(events.size() == 0 || events.ticks.back() > events.endTick) return;
+
+  EncoderState state{};
+  state.time = events.ticks.front();
+  size_t size = encodedSize(events, 0, events.size(), state, options.runningStatus);
+  encoded.bytes.resize(size + 3);
+  writeEvents(events, 0, events.size(), encoded.bytes.data(), state, options.runningStatus);
+  encoded.bytes.resize(size);
+  //the first delta time (0, one byte) is written anew for every copy
+  encoded.bytes.erase(encoded.bytes.begin());
+  encoded.statusesLeftOut = state.statusesLeftOut;
+  encoded.copied = true;
+}
+EventList MidiBuilder::expandPatterns(const EventList & events){
+  if(events.patterns.empty()) return events;
+  EventList expanded{};
+  expanded.reserve(events.size());
+  expanded.payloadSizes = events.payloadSizes;
+  expanded.payload = events.payload;
+  expanded.endTick = events.endTick;
+  size_t next = 0;
+  for(size_t i=0; i<events.size(); i++){
+    if(events.statuses[i] != 0x00){
+      expanded.push_back(events.ticks[i], events.statuses[i], events.data1[i], events.data2[i]);
+      continue;
+    }
+    const EventList & pattern = events.patterns[next++]->events;
+    unsigned shift = events.ticks[i] - pattern.ticks.front();
+    for(size_t j=0; j<pattern.size(); j++)
+      expanded.push_back(pattern.ticks[j] + shift, pattern.statuses[j], pattern.data1[j], pattern.data2[j]);
+  }
+  return expanded;
+}
+TrackReport MidiBuilder::writeTrack(const EventList & events, std::vector<unsigned char> & trackBuffer, MidiSink * streamTo,
+                                    const BuildOptions & options){
+  TrackReport report{};
+  report.events = events.size();
+  for(const EncodedPattern * pattern: events.patterns)
+    report.events += pattern->events.size() - 1;
+  unsigned time = 0;
+  if(events.size()){
+    time = events.ticks.back();
+    if(events.statuses.back() == 0x00) time += events.patterns.back()->span();
+  }
+  unsigned endDelta = std::max(events.endTick, time) - time;
+  const unsigned char header[8] = {'M', 'T', 'r', 'k', 0x00, 0x00, 0x00, 0x00};
+  const unsigned char endOfTrack[3] = {0xff, 0x2f, 0x00};
+
+  EncoderState state{};
+  if(streamTo){
+    //header chunk length stays at zero until the sink patches it
+    streamTo->beginChunk();
+    trackBuffer.insert(trackBuffer.end(), header, header + 8);
+    for(size_t first=0; first<events.size(); first+=4096){
+      size_t capacity = trackBuffer.capacity();
+      appendEvents(events, first, std::min(first + 4096, events.size()), trackBuffer, state, options.runningStatus);
+      if constexpr(collectStats) report.stats.reallocations += trackBuffer.capacity() != capacity;
+      streamTo->flushIfFull();
+    }
+    writeVarLen(trackBuffer, endDelta);
+    trackBuffer.insert(trackBuffer.end(), endOfTrack, endOfTrack + 3);
+    report.statusesLeftOut = state.statusesLeftOut;
+    report.bytes = streamTo->endChunk() + 8;
+    streamTo->flushIfFull();
+    return report;
+  }
+
+  size_t chunkStart = trackBuffer.size();
+  size_t trackLength = encodedSize(events, 0, events.size(), state, options.runningStatus)
+                     + varLenSize(endDelta) + 3;
+  if(trackLength > 0xffffffff) throw std::runtime_error("track longer than 4 GiB");
+  //the end of track takes at least 4 bytes, room for the last writeVarLen
+  size_t capacity = trackBuffer.capacity();
+  trackBuffer.resize(chunkStart + 8 + trackLength);
+  if constexpr(collectStats) report.stats.reallocations += trackBuffer.capacity() != capacity;
+  unsigned char * out = trackBuffer.data() + chunkStart;
+  std::memcpy(out, header, 8);
+  out = writeEvents(events, 0, events.size(), out + 8, state, options.runningStatus);
+  out = writeVarLen(out, endDelta);
+  std::memcpy(out, endOfTrack, 3);
+  report.statusesLeftOut = state.statusesLeftOut;
+
+  //length of track (byte 4-7 of the chunk)
+  trackBuffer[chunkStart + 4] = (trackLength & 0xff000000) >> 24;
+  trackBuffer[chunkStart + 5] = (trackLength & 0x00ff0000) >> 16;
+  trackBuffer[chunkStart + 6] = (trackLength & 0x0000ff00) >> 8;
+  trackBuffer[chunkStart + 7] = (trackLength & 0x000000ff) ;
+  report.bytes = trackLength + 8;
+  if(options.validate)
+    validateTrack(trackBuffer.data() + chunkStart + 8, trackLength);
+
+  //round trip: what a player decodes must be what was encoded
+  if(options.verify){
+    crossCheckValidation(trackBuffer.data() + chunkStart + 8, trackLength);
+    EventList decoded = decodeEvents(trackBuffer.data() + chunkStart + 8, trackLength);
+    decoded.endTick = std::max(events.endTick, time);
+    EventList expected = expandPatterns(events);
+    expected.endTick = decoded.endTick;
+    if(decoded != expected)
+      throw std::runtime_error("decoded events differ from the encoded ones");
+  }
+  return report;
+}
+TrackReport MidiBuilder::streamTrack(EventBatches & batches, std::vector<unsigned char> & trackBuffer, MidiSink & sink,
+                                     const BuildOptions & options){
+  TrackReport report{};
+  const unsigned char header[8] = {'M', 'T', 'r', 'k', 0x00, 0x00, 0x00, 0x00};
+  const unsigned char endOfTrack[3] = {0xff, 0x2f, 0x00};
+  //header chunk length stays at zero until the sink patches it
+  sink.beginChunk();
+  trackBuffer.insert(trackBuffer.end(), header, header + 8);
+
+  EncoderState state{};
+  unsigned endTick = 0;
+  std::chrono::steady_clock::time_point now{};
+  if constexpr(collectStats) now = std::chrono::steady_clock::now();
+  while(batches.next()){
+    const EventList & events = batches.batch();
+    if constexpr(collectStats){
+      auto built = std::chrono::steady_clock::now();
+      report.stats.buildSeconds += std::chrono::duration<double>(built - now).count();
+      now = built;
+    }
+    report.events += events.size();
+    for(const EncodedPattern * pattern: events.patterns)
+      report.events += pattern->events.size() - 1;
+    //the payloads and patterns of a batch are numbered from its start
+    state.payloadIndex = state.payloadOffset = state.patternIndex = 0;
+    size_t capacity = trackBuffer.capacity();
+    appendEvents(events, 0, events.size(), trackBuffer, state, options.runningStatus);
+    if constexpr(collectStats) report.stats.reallocations += trackBuffer.capacity() != capacity;
+    endTick = std::max(endTick, events.endTick);
+    sink.flushIfFull();
+    if constexpr(collectStats){
+      auto encoded = std::chrono::steady_clock::now();
+      report.stats.encodeSeconds += std::chrono::duration<double>(encoded - now).count();
+      now = encoded;
+    }
+  }
+  writeVarLen(trackBuffer, std::max(endTick, state.time) - state.time);
+  trackBuffer.insert(trackBuffer.end(), endOfTrack, endOfTrack + 3);
+  report.statusesLeftOut = state.statusesLeftOut;
+  report.bytes = sink.endChunk() + 8;
+  sink.flushIfFull();
+  return report;
+}
+TrackReport MidiBuilder::mergeTracks(const std::vector<MidiFileReader::Chunk> & chunks, MidiSink & sink,
+                                     const BuildOptions & options){
+  struct Next{
+    unsigned tick;
+    size_t track;
+  };
+  auto later = [](const Next & a, const Next & b){
+    return a.tick != b.tick ? a.tick > b.tick : a.track > b.track;
+  };
+  std::vector<EventReader> readers{};
+  std::vector<MidiEvent> events(chunks.size());
+  std::vector<Next> heap{};
+  unsigned endTick = 0;
+  for(size_t i=0; i<chunks.size(); i++){
+    readers.emplace_back(chunks[i].data, chunks[i].size);
+    if(readers[i].next(events[i]))
+      heap.push_back(Next{events[i].tick, i});
+    else
+      endTick = std::max(endTick, readers[i].time());
+  }
+  std::make_heap(heap.begin(), heap.end(), later);
+
+  std::vector<unsigned char> & buffer = sink.buffer();
+  const unsigned char header[8] = {'M', 'T', 'r', 'k', 0x00, 0x00, 0x00, 0x00};
+  const unsigned char endOfTrack[3] = {0xff, 0x2f, 0x00};
+  sink.beginChunk();
+  buffer.insert(buffer.end(), header, header + 8);
+
+  TrackReport report{};
+  EncoderState state{};
+  EventList batch{};
+  batch.reserve(4096);
+  auto writeBatch = [&]{
+    transformTrack(batch, options);
+    appendEvents(batch, 0, batch.size(), buffer, state, options.runningStatus);
+    report.events += batch.size();
+    batch.clear();
+    state.payloadIndex = 0;
+    state.payloadOffset = 0;
+    sink.flushIfFull();
+  };
+  //notes of different tracks on the same channel can overlap once merged
+  NoteTable notes{};
+  while(!heap.empty()){
+    std::pop_heap(heap.begin(), heap.end(), later);
+    size_t i = heap.back().track;
+    if(!options.repairNotes || notes.keep(events[i]))
+      batch.push_back(events[i]);
+    if(readers[i].next(events[i])){
+      heap.back().tick = events[i].tick;
+      std::push_heap(heap.begin(), heap.end(), later);
+    }
+    else{
+      endTick = std::max(endTick, readers[i].time());
+      heap.pop_back();
+    }
+    if(batch.size() == 4096) writeBatch();
+  }
+  if(options.repairNotes){
+    notes.endAll([&](unsigned char status, unsigned char note){
+      batch.push_back(endTick, status, note, 0);
+    });
+    addRepairs(report, notes);
+  }
+  writeBatch();
+
+  //the merged track ends with the last of them
+  if(options.transform.active()) endTick = transformTick(endTick, options.transform);
+  writeVarLen(buffer, std::max(endTick, state.time) - state.time);
+  buffer.insert(buffer.end(), endOfTrack, endOfTrack + 3);
+  report.statusesLeftOut = state.statusesLeftOut;
+  report.bytes = sink.endChunk() + 8;
+  sink.flushIfFull();
+  return report;
+}
+void MidiBuilder::appendEvents(const EventList & events, size_t first, size_t last, std::vector<unsigned char> & buffer,
+                               EncoderState & state, bool runningStatus){
+  //writeVarLen stores 4 bytes, the last quantity may need 3 more
+  size_t used = buffer.size();
+  size_t size = encodedSize(events, first, last, state, runningStatus);
+  buffer.resize(used + size + 3);
+  writeEvents(events, first, last, buffer.data() + used, state, runningStatus);
+  buffer.resize(used + size);
+}
+size_t MidiBuilder::encodedSize(const EventList & events, size_t first, size_t last, EncoderState state,
+                                bool runningStatus){
+  size_t size = 0;
+  for(size_t i=first; i<last; i++){
+    size += varLenSize(events.ticks[i] - state.time);
+    state.time = events.ticks[i];
+    if(events.statuses[i] == 0x00){
+      const EncodedPattern & pattern = *events.patterns[state.patternIndex++];
+      size += pattern.bytes.size() - (runningStatus && pattern.bytes[0] == state.status);
+      state.time += pattern.span();
+      state.status = pattern.events.statuses.back();
+      continue;
+    }
+    if(events.statuses[i] >= 0xf0){
+      state.status = 0;
+      unsigned payloadSize = events.payloadSizes[state.payloadIndex++];
+      size += (events.statuses[i] == 0xff ? 2 : 1) + varLenSize(payloadSize) + payloadSize;
+      continue;
+    }
+    if(!runningStatus || events.statuses[i] != state.status){
+      state.status = events.statuses[i];
+      size++;
+    }
+    size += hasData2(events.statuses[i]) ? 2 : 1;
+  }
+  return size;
+}
+unsigned char * MidiBuilder::writeEvents(const EventList & events, size_t first, size_t last, unsigned char * out,
+                                         EncoderState & state, bool runningStatus){
+  for(size_t i=first; i<last; i++){
+    out = writeVarLen(out, events.ticks[i] - state.time);
+    state.time = events.ticks[i];
+    if(events.statuses[i] == 0x00){
+      //an encoded pattern, its first status byte left out if it repeats the
+      //previous one
+      const EncodedPattern & pattern = *events.patterns[state.patternIndex++];
+      size_t skip = runningStatus && pattern.bytes[0] == state.status;
+      std::memcpy(out, pattern.bytes.data() + skip, pattern.bytes.size() - skip);
+      out += pattern.bytes.size() - skip;
+      state.statusesLeftOut += skip + pattern.statusesLeftOut;
+      state.time += pattern.span();
+      state.status = pattern.events.statuses.back();
+      continue;
+    }
+    if(events.statuses[i] >= 0xf0){
+      //meta and system exclusive events, which cancel running status
+      state.status = 0;
+      *out++ = events.statuses[i];
+      if(events.statuses[i] == 0xff)
+        *out++ = events.data1[i];
+      unsigned size = events.payloadSizes[state.payloadIndex++];
+      out = writeVarLen(out, size);
+      std::memcpy(out, events.payload.data() + state.payloadOffset, size);
+      out += size;
+      state.payloadOffset += size;
+      continue;
+    }
+    if(runningStatus && events.statuses[i] == state.status){
+      state.statusesLeftOut++;
+    }
+    else{
+      state.status = events.statuses[i];
+      *out++ = state.status;
+    }
+    *out++ = events.data1[i];
+    if(hasData2(events.statuses[i]))
+      *out++ = events.data2[i];
+  }
+  return out;
+}
+void MidiBuilder::programChange(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event){
+  unsigned char programNumber = event.number & 0x000000ff; //0-127
+  track.add(track.cursor, 0xc0 + channelNumber, programNumber);
+}
+void MidiBuilder::rampControlChange(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event){
+  unsigned char controlNumber = event.number & 0x000000ff; //0-127
+  ramp(track, event, 0xff, [&](unsigned tick, int value){
+    track.add(tick, 0xb0 + channelNumber, controlNumber, value);
+  });
+}
+void MidiBuilder::rampPitchWheelChange(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event){
+  ramp(track, event, 0x3fff, [&](unsigned tick, int value){
+    unsigned char high = (value & 0b11111110000000) >> 7;
+    unsigned char low = (value &  0b00000001111111);
+    track.add(tick, 0xe0 + channelNumber, low, high);
+  });
+}
+int MidiBuilder::rampValue(const TrackEvent & event, int step){
+  long long diff = static_cast<long long>(event.endValue) - event.startValue;
+  if(event.shape == 0)
+    return event.startValue + step * diff / event.steps;
+  double x = static_cast<double>(step) / event.steps;
+  double y = event.shape == 1 ? std::expm1(4 * x) / std::expm1(4.0)  //slow start, fast end
+                              : x * x * (3 - 2 * x);                  //smoothstep
+  return event.startValue + std::llround(y * diff);
+}
+template<typename Send>
+void MidiBuilder::ramp(TrackScheduler & track, const TrackEvent & event, int mask, Send send){
+  //its steps would go back in time
+  if(event.rampDuration < 0)
+    throw std::runtime_error("ramp duration " + std::to_string(event.rampDuration) + " is negative");
+  track.cursor += event.deltaTime;
+  unsigned start = track.cursor;
+  send(start, event.startValue);
+
+  int sentValue = event.startValue;
+  unsigned sentTick = start;
+  for(int step=1;step<=event.steps;step++){
+    int value = rampValue(event, step);
+    unsigned tick = start + static_cast<unsigned>(static_cast<long long>(event.rampDuration) * step / event.steps);
+    if((value & mask) == (sentValue & mask)) continue;
+    if(step < event.steps &&
+       (std::llabs(static_cast<long long>(value) - sentValue) <= event.maxError ||
+        tick - sentTick < event.minInterval)) continue;
+    send(tick, value);
+    sentValue = value;
+    sentTick = tick;
+  }
+  if(event.steps > 0) track.cursor = start + event.rampDuration;
+}
+void MidiBuilder::controlChange(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event){
+  unsigned char controlNumber = event.number & 0x000000ff; //0-127
+  unsigned char controlValue = event.value & 0x000000ff; //0-127
+  track.cursor += event.deltaTime;
+  track.add(track.cursor, 0xb0 + channelNumber, controlNumber, controlValue);
+}
+void MidiBuilder::pitchWheelChange(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event){
+  unsigned pitchWheelValue = event.value; //0-0x4000
+  unsigned char high = (pitchWheelValue & 0b11111110000000) >> 7;
+  unsigned char low = (pitchWheelValue &  0b00000001111111);
+  track.cursor += event.deltaTime;
+  track.add(track.cursor, 0xe0 + channelNumber, low, high);
+}
+void MidiBuilder::buildNotes(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event,
+                             std::span<const unsigned char> noteNumbers){
+  writeSimultaneousNotes(
+    track,
+    channelNumber,
+    event.deltaTime,
+    event.duration,
+    event.velocity,
+    noteNumbers);
+}
+void MidiBuilder::holdNotes(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event,
+                            std::span<const unsigned char> noteNumbers){
+  track.cursor += event.deltaTime;
+  for(auto noteNumber: noteNumbers)
+    track.add(track.cursor, 0x90 + channelNumber, noteNumber, event.velocity);
+  for(auto noteNumber: noteNumbers)
+    track.schedule(track.cursor + event.duration, 0x90 + channelNumber, noteNumber, 0x00);
+}
+void MidiBuilder::writeSimultaneousNotes(
+  TrackScheduler & track,
+  unsigned char channelNumber,
+  unsigned deltaTime,
+  unsigned duration,
+  unsigned velocity,
+  std::span<const unsigned char> noteNumbers)
+{
+  //every note-on is deltaTime after the previous one
+  for(auto noteNumber: noteNumbers){
+    track.cursor += deltaTime;
+    track.add(track.cursor, 0x90 + channelNumber, noteNumber, velocity);
+  }
+
+  track.cursor += duration;
+  for(auto noteNumber: noteNumbers)
+    track.add(track.cursor, 0x90 + channelNumber, noteNumber, 0x00);
+}
+void MidiBuilder::arpeggio(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event,
+                           std::span<const unsigned char> noteNumbers, Random & random){
+  if(noteNumbers.empty()) return;
+
+  if(event.arpMode == 1){
+    for(unsigned i=0; i<event.number; i++){
+      writeSimultaneousNotes(
+        track,
+        channelNumber,
+        event.deltaTime,
+        event.duration,
+        event.velocity,
+        {&noteNumbers[random.below(noteNumbers.size())], 1});
+    }
+    return;
+  }
+
+  auto iter = noteNumbers.begin();
+  for(unsigned i=0; i<event.number; i++){
+    writeSimultaneousNotes(
+      track,
+      channelNumber,
+      event.deltaTime,
+      event.duration,
+      event.velocity,
+      {iter, 1});
+    iter++;
+    if(iter == noteNumbers.end()) iter = noteNumbers.begin();
+  }
+}
+
+
+std::vector<unsigned char> buildMidi(const Song & song, const BuildOptions & options){
+  MidiSink sink{};
+  MidiBuilder(sink, options).write(song);
+  return std::move(sink.buffer());
+}
@@ -0,0 +1,1036 @@
+#ifndef MIDIBUILDER_HPP
+#define MIDIBUILDER_HPP
+
+#include <vector>
+#include <string>
+#include <array>
+#include <algorithm>
+#include <span>
+#include <initializer_list>
+#include <bit>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <type_traits>
+#include <sys/types.h>
+
+
+//counters and timers of the hot paths, compiled in with -DMIDIBUILDER_STATS.
+//without it the code collecting them is discarded.
+#ifdef MIDIBUILDER_STATS
+constexpr bool collectStats = true;
+#else
+constexpr bool collectStats = false;
+#endif
+
+
+//largest value a variable length quantity (delta time) can hold
+constexpr unsigned maxVarLen = 0x0FFFFFFF;
+
+//number of bytes (1-4) in the variable length quantity of n
+constexpr unsigned varLenSize(unsigned n){
+  return 1 + (std::bit_width(n | 1) - 1) / 7;
+}
+
+//variable length quantity of n packed into an unsigned, first byte in the
+//lowest 8 bits, continuation bits set
+constexpr unsigned varLenPack(unsigned n){
+  unsigned groups = (n & 0x0000007f) << 24
+                  | (n & 0x00003f80) << 9
+                  | (n & 0x001fc000) >> 6
+                  | (n & 0x0fe00000) >> 21;
+  return (groups | 0x00808080) >> (8 * (4 - varLenSize(n)));
+}
+
+//write the variable length quantity of n at out, which must have room for
+//4 bytes. returns the end of the quantity.
+constexpr unsigned char * writeVarLen(unsigned char * out, unsigned n){
+  if(n > maxVarLen)
+    throw std::out_of_range("delta time larger than 0x0FFFFFFF");
+  unsigned packed = varLenPack(n);
+  if(std::is_constant_evaluated() || std::endian::native != std::endian::little){
+    for(unsigned i=0; i<4; i++)
+      out[i] = (packed >> (8 * i)) & 0xff;
+  }
+  else{
+    std::memcpy(out, &packed, 4);
+  }
+  return out + varLenSize(n);
+}
+
+//read a variable length quantity, advancing p
+constexpr unsigned readVarLen(const unsigned char *& p, const unsigned char * end){
+  unsigned n = 0;
+  for(unsigned i=0; i<4; i++){
+    if(p == end) throw std::runtime_error("truncated delta time");
+    unsigned char c = *p++;
+    n = (n << 7) | (c & 0x7f);
+    if(!(c & 0x80)) return n;
+  }
+  throw std::runtime_error("delta time longer than 4 bytes");
+}
+
+//append the variable length quantity of n
+constexpr void writeVarLen(std::vector<unsigned char> & buffer, unsigned n){
+  unsigned char bytes[4]{};
+  buffer.insert(buffer.end(), bytes, writeVarLen(bytes, n));
+}
+
+static_assert(varLenPack(0x00) == 0x00);
+static_assert(varLenPack(0x7f) == 0x7f);
+static_assert(varLenPack(0x80) == 0x0081);
+static_assert(varLenPack(0x3fff) == 0x7fff);
+static_assert(varLenPack(0x4000) == 0x008081);
+static_assert(varLenPack(0x0fffffff) == 0x7fffffff);
+
+//the header chunk of a midi file
+constexpr std::array<unsigned char, 14> midiHeader(unsigned short fileType, unsigned short numberOfTracks,
+                                                   unsigned short divisionTime){
+  return {
+    //header chunk magick
+    'M', 'T', 'h', 'd',
+    //header chunk length, always 6
+    0x00, 0x00, 0x00, 0x06,
+    //midi file type
+    static_cast<unsigned char>((fileType & 0xFF00) >> 8),
+    static_cast<unsigned char>(fileType & 0x00FF),
+    //midi file number of tracks
+    static_cast<unsigned char>((numberOfTracks & 0xFF00) >> 8),
+    static_cast<unsigned char>(numberOfTracks & 0x00FF),
+    //midi file division time
+    static_cast<unsigned char>((divisionTime & 0xFF00) >> 8),
+    static_cast<unsigned char>(divisionTime & 0x00FF)};
+}
+
+
+//what writing to disk took, collected when collectStats is set
+struct SinkStats{
+  size_t writes{};
+  size_t bytes{};
+  double writeSeconds{};
+};
+
+//streams the midi file to disk in large blocks while it is being built.
+//when a chunk ends its length is patched in place, in the block if it is
+//still there or in the file otherwise. outputs that can't seek (pipes) hold
+//back the open chunk instead, so at most one track is buffered.
+class MidiSink{
+
+int fd{-1};
+bool seekable{false};
+std::string tempPath{};   //set while streaming to a temporary file
+std::string targetPath{}; //what finish() renames it to
+off_t blockOffset{};      //file offset of block[0]
+off_t chunkOffset{-1};    //file offset of the open chunk, -1 if none
+std::vector<unsigned char> block{};
+SinkStats sinkStats{};
+
+  void writeAll(const unsigned char * data, size_t size);
+  void flush();
+
+public:
+  static constexpr size_t blockSize = 1 << 16;
+
+  //stream to path, "-" for stdout. a file is streamed to a temporary one
+  //next to it that finish() renames over it, so that a build that fails
+  //leaves it as it was. pipes and devices are written to directly.
+  explicit MidiSink(const std::string & path);
+  //keep the whole file in memory, buffer() holds it once finished
+  MidiSink();
+  MidiSink(const MidiSink &) = delete;
+  MidiSink & operator=(const MidiSink &) = delete;
+  ~MidiSink();
+
+  //bytes not yet written, builders append here
+  std::vector<unsigned char> & buffer(){
+    return block;
+  }
+  //the chunk header is about to be appended
+  void beginChunk(){
+    chunkOffset = blockOffset + block.size();
+  }
+  //patch the length of the open chunk, and return it
+  size_t endChunk();
+  void flushIfFull(){
+    if(block.size() >= blockSize) flush();
+  }
+  //append complete chunks, large ones are written without copying
+  void write(const std::vector<unsigned char> & bytes);
+  //write what is left, and rename the temporary file over the path
+  void finish();
+  const SinkStats & stats() const{
+    return sinkStats;
+  }
+};
+
+
+//one event of a track script, as read from the script. which of the fields
+//are used depends on the kind (the event selection number)
+struct TrackEvent{
+  unsigned kind{};
+  unsigned deltaTime{};
+  unsigned duration{};    //notes and arpeggio
+  unsigned velocity{};    //notes and arpeggio
+  unsigned number{};      //program, channel, control or pattern number, arpeggio notes to play
+  unsigned arpMode{};     //arpeggio: 0 in order, 1 in random order
+  unsigned value{};       //control or pitch wheel value
+  int startValue{};       //ramps
+  int endValue{};
+  int rampDuration{};
+  int steps{};
+  unsigned shape{};       //shaped ramps: 0 linear, 1 exponential, 2 s-curve
+  unsigned maxError{};    //shaped ramps: steps this close to the last value sent are left out
+  unsigned minInterval{}; //shaped ramps: ticks between two values sent
+  unsigned times{};       //pattern repeats
+  unsigned firstNote{};   //note numbers, in the note numbers of the track
+  unsigned noteCount{};
+};
+
+//the events of a track, read from a script or added with the functions below
+struct Track{
+  std::vector<TrackEvent> events{};
+  std::vector<unsigned char> noteNumbers{};  //of all the events, one after the other
+
+  constexpr std::span<const unsigned char> notes(const TrackEvent & event) const{
+    return {noteNumbers.data() + event.firstNote, event.noteCount};
+  }
+
+  //the events of a script, one function each. they return the track, so
+  //that events can be chained: track.channel(1).note(0, 480, 100, 60).
+  //values out of the range the script takes throw std::out_of_range.
+  constexpr Track & note(unsigned deltaTime, unsigned duration, unsigned velocity, unsigned char noteNumber);
+  //every note-on is deltaTime after the previous one, the notes end together
+  constexpr Track & chord(unsigned deltaTime, unsigned duration, unsigned velocity, std::span<const unsigned char> noteNumbers);
+  constexpr Track & chord(unsigned deltaTime, unsigned duration, unsigned velocity, std::initializer_list<unsigned char> noteNumbers){
+    return chord(deltaTime, duration, velocity, std::span(noteNumbers.begin(), noteNumbers.size()));
+  }
+  //the next event is timed from the start of the held notes
+  constexpr Track & heldNotes(unsigned deltaTime, unsigned duration, unsigned velocity, std::span<const unsigned char> noteNumbers);
+  constexpr Track & heldNotes(unsigned deltaTime, unsigned duration, unsigned velocity, std::initializer_list<unsigned char> noteNumbers){
+    return heldNotes(deltaTime, duration, velocity, std::span(noteNumbers.begin(), noteNumbers.size()));
+  }
+  constexpr Track & rest(unsigned deltaTime);
+  //count notes, cycling through noteNumbers or drawn from them at random
+  constexpr Track & arpeggio(unsigned deltaTime, unsigned duration, unsigned velocity, unsigned count,
+                             std::span<const unsigned char> noteNumbers, bool randomOrder = false);
+  constexpr Track & arpeggio(unsigned deltaTime, unsigned duration, unsigned velocity, unsigned count,
+                             std::initializer_list<unsigned char> noteNumbers, bool randomOrder = false){
+    return arpeggio(deltaTime, duration, velocity, count, std::span(noteNumbers.begin(), noteNumbers.size()), randomOrder);
+  }
+  constexpr Track & programChange(unsigned program);
+  constexpr Track & controlChange(unsigned deltaTime, unsigned control, unsigned value);
+  constexpr Track & channel(unsigned channel);
+  constexpr Track & pitchWheelChange(unsigned deltaTime, unsigned value);
+  //shape 0 linear, 1 exponential, 2 s-curve. maxError and minInterval thin
+  //the steps out, see the shaped ramps of the scripts
+  constexpr Track & rampControlChange(unsigned deltaTime, unsigned control, int startValue, int endValue, int duration, int steps,
+                                      unsigned shape = 0, unsigned maxError = 0, unsigned minInterval = 0);
+  constexpr Track & rampPitchWheelChange(unsigned deltaTime, int startValue, int endValue, int duration, int steps,
+                                         unsigned shape = 0, unsigned maxError = 0, unsigned minInterval = 0);
+  //play pattern number pattern of the song times in a row, the first time
+  //deltaTime after the previous event
+  constexpr Track & repeat(unsigned deltaTime, unsigned pattern, unsigned times);
+
+private:
+  constexpr Track & add(const TrackEvent & event, std::span<const unsigned char> eventNoteNumbers = {});
+  static constexpr unsigned checked(unsigned value, unsigned max, const char * what){
+    if(value > max) throw std::out_of_range(what);
+    return value;
+  }
+  //the velocity and the note numbers of notes, chords and arpeggios
+  static constexpr unsigned checkedNotes(unsigned velocity, std::span<const unsigned char> noteNumbers){
+    for(auto noteNumber: noteNumbers)
+      checked(noteNumber, 127, "note number above 127");
+    return checked(velocity, 127, "velocity above 127");
+  }
+};
+
+constexpr Track & Track::add(const TrackEvent & event, std::span<const unsigned char> eventNoteNumbers){
+  TrackEvent & added = events.emplace_back(event);
+  added.firstNote = noteNumbers.size();
+  added.noteCount = eventNoteNumbers.size();
+  noteNumbers.insert(noteNumbers.end(), eventNoteNumbers.begin(), eventNoteNumbers.end());
+  return *this;
+}
+constexpr Track & Track::note(unsigned deltaTime, unsigned duration, unsigned velocity, unsigned char noteNumber){
+  return chord(deltaTime, duration, velocity, {noteNumber});
+}
+constexpr Track & Track::chord(unsigned deltaTime, unsigned duration, unsigned velocity, std::span<const unsigned char> noteNumbers){
+  TrackEvent event{};
+  event.kind = std::clamp<size_t>(noteNumbers.size(), 1, 4);
+  event.deltaTime = deltaTime;
+  event.duration = duration;
+  event.velocity = checkedNotes(velocity, noteNumbers);
+  return add(event, noteNumbers);
+}
+constexpr Track & Track::heldNotes(unsigned deltaTime, unsigned duration, unsigned velocity, std::span<const unsigned char> noteNumbers){
+  TrackEvent event{};
+  event.kind = 5;
+  event.deltaTime = deltaTime;
+  event.duration = duration;
+  event.velocity = checkedNotes(velocity, noteNumbers);
+  return add(event, noteNumbers);
+}
+constexpr Track & Track::rest(unsigned deltaTime){
+  TrackEvent event{};
+  event.kind = 6;
+  event.deltaTime = deltaTime;
+  return add(event);
+}
+constexpr Track & Track::arpeggio(unsigned deltaTime, unsigned duration, unsigned velocity, unsigned count,
+                                  std::span<const unsigned char> noteNumbers, bool randomOrder){
+  TrackEvent event{};
+  event.kind = 9;
+  event.deltaTime = deltaTime;
+  event.duration = duration;
+  event.velocity = checkedNotes(velocity, noteNumbers);
+  event.number = count;
+  event.arpMode = randomOrder;
+  return add(event, noteNumbers);
+}
+constexpr Track & Track::programChange(unsigned program){
+  TrackEvent event{};
+  event.kind = 10;
+  event.number = checked(program, 127, "program number above 127");
+  return add(event);
+}
+constexpr Track & Track::controlChange(unsigned deltaTime, unsigned control, unsigned value){
+  TrackEvent event{};
+  event.kind = 11;
+  event.deltaTime = deltaTime;
+  event.number = checked(control, 127, "control number above 127");
+  event.value = checked(value, 127, "control value above 127");
+  return add(event);
+}
+constexpr Track & Track::channel(unsigned channel){
+  TrackEvent event{};
+  event.kind = 12;
+  event.number = checked(channel, 15, "channel number above 15");
+  return add(event);
+}
+constexpr Track & Track::pitchWheelChange(unsigned deltaTime, unsigned value){
+  TrackEvent event{};
+  event.kind = 13;
+  event.deltaTime = deltaTime;
+  event.value = checked(value, 0x3fff, "pitch wheel value above 0x3FFF");
+  return add(event);
+}
+constexpr Track & Track::rampControlChange(unsigned deltaTime, unsigned control, int startValue, int endValue, int duration, int steps,
+                                           unsigned shape, unsigned maxError, unsigned minInterval){
+  TrackEvent event{};
+  event.kind = 22;
+  event.deltaTime = deltaTime;
+  event.number = checked(control, 127, "control number above 127");
+  event.startValue = startValue;
+  event.endValue = endValue;
+  event.rampDuration = duration;
+  event.steps = steps;
+  event.shape = shape;
+  event.maxError = maxError;
+  event.minInterval = minInterval;
+  return add(event);
+}
+constexpr Track & Track::rampPitchWheelChange(unsigned deltaTime, int startValue, int endValue, int duration, int steps,
+                                              unsigned shape, unsigned maxError, unsigned minInterval){
+  TrackEvent event{};
+  event.kind = 23;
+  event.deltaTime = deltaTime;
+  event.startValue = startValue;
+  event.endValue = endValue;
+  event.rampDuration = duration;
+  event.steps = steps;
+  event.shape = shape;
+  event.maxError = maxError;
+  event.minInterval = minInterval;
+  return add(event);
+}
+constexpr Track & Track::repeat(unsigned deltaTime, unsigned pattern, unsigned times){
+  TrackEvent event{};
+  event.kind = 7;
+  event.deltaTime = deltaTime;
+  event.number = pattern;
+  event.times = times;
+  return add(event);
+}
+
+//a midi file to build: its header info and its tracks
+struct Song{
+  unsigned short fileType{1};
+  unsigned short divisionTime{480};  //ticks per quarter note
+  std::vector<Track> tracks{};
+  //events any track can repeat, numbered in order. a pattern starts on the
+  //channel of the track repeating it, its channel changes only last until
+  //its end. patterns can't repeat patterns.
+  std::vector<Track> patterns{};
+
+  //the new track, valid until the next one is added
+  constexpr Track & addTrack(){
+    return tracks.emplace_back();
+  }
+  //the new pattern, number patterns.size() - 1
+  constexpr Track & addPattern(){
+    return patterns.emplace_back();
+  }
+};
+
+
+//channel messages with one data byte (program change, channel pressure)
+//instead of two
+constexpr bool hasData2(unsigned char status){
+  return (status & 0xe0) != 0xc0;
+}
+
+//one event of a track chunk, read in place
+struct MidiEvent{
+  unsigned tick{};
+  unsigned char status{};       //0xff for meta events, 0xf0/0xf7 for system exclusive
+  unsigned char type{};         //meta event type
+  const unsigned char * data{}; //the data bytes, or the meta/system exclusive payload
+  unsigned size{};
+};
+
+//reads the events of a track chunk body one at a time, in place, running
+//status included
+class EventReader{
+
+const unsigned char * p{};
+const unsigned char * end{};
+unsigned tick{};
+unsigned char status{};
+
+public:
+  EventReader(const unsigned char * data, size_t size): p(data), end(data + size){}
+
+  //the next event, false at the end of track
+  bool next(MidiEvent & event){
+    if(p == end) return false;
+    tick += readVarLen(p, end);
+    if(p == end) throw std::runtime_error("truncated event");
+    event.tick = tick;
+    if(*p == 0xff || *p == 0xf0 || *p == 0xf7){
+      event.status = *p++;
+      event.type = 0;
+      if(event.status == 0xff){
+        if(p == end) throw std::runtime_error("truncated meta event");
+        event.type = *p++;
+      }
+      event.size = readVarLen(p, end);
+      if(static_cast<size_t>(end - p) < event.size) throw std::runtime_error("truncated meta event");
+      event.data = p;
+      p += event.size;
+      if(event.status == 0xff && event.type == 0x2f){
+        p = end;
+        return false;
+      }
+      return true;
+    }
+    if(*p & 0x80){
+      if(*p > 0xef) throw std::runtime_error("system message in a track");
+      status = *p++;
+    }
+    else if(!status){
+      throw std::runtime_error("data byte without a status");
+    }
+    event.status = status;
+    event.size = hasData2(status) ? 2 : 1;
+    if(static_cast<size_t>(end - p) < event.size) throw std::runtime_error("truncated event");
+    event.data = p;
+    p += event.size;
+    return true;
+  }
+  //tick of the last event read, or of the end of track once reached
+  unsigned time() const{
+    return tick;
+  }
+};
+
+struct EncodedPattern;
+
+//events at absolute ticks, as a struct of arrays. meta and system exclusive
+//events keep their type in data1, their payloads follow each other in payload.
+//status 0 stands for a whole encoded pattern, at the tick of its first event,
+//the patterns follow each other in patterns.
+struct EventList{
+  std::vector<unsigned> ticks{};
+  std::vector<unsigned char> statuses{};
+  std::vector<unsigned char> data1{};
+  std::vector<unsigned char> data2{};
+  std::vector<unsigned> payloadSizes{};
+  std::vector<unsigned char> payload{};
+  std::vector<const EncodedPattern *> patterns{};
+  unsigned endTick{};  //the end of track is at least this late
+
+  size_t size() const{
+    return ticks.size();
+  }
+  void clear(){
+    ticks.clear();
+    statuses.clear();
+    data1.clear();
+    data2.clear();
+    payloadSizes.clear();
+    payload.clear();
+    patterns.clear();
+    endTick = 0;
+  }
+  void reserve(size_t n){
+    ticks.reserve(n);
+    statuses.reserve(n);
+    data1.reserve(n);
+    data2.reserve(n);
+  }
+  void push_back(unsigned tick, unsigned char status, unsigned char d1, unsigned char d2){
+    ticks.push_back(tick);
+    statuses.push_back(status);
+    data1.push_back(d1);
+    data2.push_back(d2);
+  }
+  void push_back(const MidiEvent & event){
+    if(event.status < 0xf0){
+      push_back(event.tick, event.status, event.data[0], event.size == 2 ? event.data[1] : 0);
+      return;
+    }
+    push_back(event.tick, event.status, event.type, 0);
+    payloadSizes.push_back(event.size);
+    payload.insert(payload.end(), event.data, event.data + event.size);
+  }
+  bool operator==(const EventList &) const = default;
+};
+
+//the events of a pattern on one channel, encoded once, so that every time
+//the pattern is played its bytes are copied with only the first delta time
+//written anew
+struct EncodedPattern{
+  bool copied{};       //false if the pattern has to be built every time
+  EventList events{};  //ticks from the start of the pattern, endTick is its length
+  std::vector<unsigned char> bytes{};  //the events from the first status byte on
+  size_t statusesLeftOut{};
+
+  //ticks from the first event to the last one
+  unsigned span() const{
+    return events.ticks.back() - events.ticks.front();
+  }
+};
+
+//the events of a track, built lazily by a coroutine: it builds a batch and
+//stays suspended until next() asks for the one after. every batch is final
+//(in tick order, and nothing built later goes before it), so a consumer can
+//encode or play it while the rest isn't built yet, and stop at any tick by
+//dropping the EventBatches.
+class EventBatches{
+
+struct Promise;
+std::coroutine_handle<Promise> handle{};
+
+  explicit EventBatches(std::coroutine_handle<Promise> handle): handle(handle){}
+
+public:
+  using promise_type = Promise;
+
+  EventBatches(EventBatches && other) noexcept: handle(std::exchange(other.handle, {})){}
+  EventBatches & operator=(EventBatches other) noexcept{
+    std::swap(handle, other.handle);
+    return *this;
+  }
+  ~EventBatches(){
+    if(handle) handle.destroy();
+  }
+
+  //build the next batch, false once the track is done. throws what building
+  //it threw.
+  bool next();
+  //the batch next() built, valid until it is called again. only the last
+  //batch has the end tick of the track.
+  const EventList & batch() const;
+};
+
+struct EventBatches::Promise{
+  const EventList * batch{};
+  std::exception_ptr error{};
+
+  EventBatches get_return_object(){
+    return EventBatches(std::coroutine_handle<Promise>::from_promise(*this));
+  }
+  std::suspend_always initial_suspend() noexcept{
+    return {};
+  }
+  std::suspend_always final_suspend() noexcept{
+    return {};
+  }
+  std::suspend_always yield_value(const EventList & events) noexcept{
+    batch = &events;
+    return {};
+  }
+  void return_void() noexcept{}
+  void unhandled_exception() noexcept{
+    error = std::current_exception();
+  }
+};
+
+inline bool EventBatches::next(){
+  handle.resume();
+  if(handle.promise().error) std::rethrow_exception(std::exchange(handle.promise().error, {}));
+  return !handle.done();
+}
+inline const EventList & EventBatches::batch() const{
+  return *handle.promise().batch;
+}
+
+
+//the notes sounding on every channel, counted as the events of a track go
+//by in tick order, so that they can be repaired in the same pass: a note-on
+//of a note already sounding is merged into it (only the last of their
+//note-offs is kept), a note-off of a note not sounding is left out, and
+//notes still sounding at the end of the track get a note-off.
+class NoteTable{
+
+std::array<unsigned, 16 * 128> sounding{};  //by channel and note number
+
+public:
+  size_t merged{};   //note-ons of notes already sounding
+  size_t dropped{};  //note-offs of notes not sounding
+  size_t ended{};    //note-offs added at the end
+
+  //false if the event is to be left out
+  bool keep(unsigned char status, unsigned char note, unsigned char velocity){
+    unsigned char kind = status & 0xf0;
+    if(kind != 0x80 && kind != 0x90) return true;
+    unsigned & count = sounding[(status & 0x0f) << 7 | (note & 0x7f)];
+    if(kind == 0x90 && velocity){
+      merged += count != 0;
+      return count++ == 0;
+    }
+    if(count == 0){
+      dropped++;
+      return false;
+    }
+    return --count == 0;
+  }
+  bool keep(const MidiEvent & event){
+    return keep(event.status, event.size ? event.data[0] : 0, event.size == 2 ? event.data[1] : 0);
+  }
+  //true if something had to be repaired
+  bool repaired() const{
+    return merged || dropped || ended;
+  }
+  //the note-ons of the notes still sounding, with velocity 0, to add(status,
+  //note), by channel and note number
+  template<typename Add>
+  void endAll(Add add){
+    for(unsigned i=0; i<sounding.size(); i++){
+      if(!sounding[i]) continue;
+      add(static_cast<unsigned char>(0x90 | i >> 7), static_cast<unsigned char>(i & 0x7f));
+      sounding[i] = 0;
+      ended++;
+    }
+  }
+};
+
+
+//puts the events of a track in tick order. the builders make events in tick
+//order, except for the note-offs of held notes, which wait in a min-heap
+//until the track reaches their tick. events on the same tick keep the order
+//they were made in.
+class TrackScheduler{
+
+struct Pending{
+  unsigned tick;
+  unsigned order;
+  unsigned char status;
+  unsigned char data1;
+  unsigned char data2;
+};
+struct Later{
+  bool operator()(const Pending & a, const Pending & b) const{
+    return a.tick != b.tick ? a.tick > b.tick : a.order > b.order;
+  }
+};
+std::priority_queue<Pending, std::vector<Pending>, Later> pending{};
+unsigned order{};
+NoteTable * notes{};
+unsigned lastTick{};  //of the last event, or the end of the last pattern
+
+  void push(unsigned tick, unsigned char status, unsigned char data1, unsigned char data2){
+    if(notes && !notes->keep(status, data1, data2)) return;
+    if constexpr(collectStats)
+      reallocations += events.size() == events.ticks.capacity();
+    events.push_back(tick, status, data1, data2);
+    lastTick = tick;
+  }
+  void release(unsigned tick){
+    while(!pending.empty() && pending.top().tick <= tick){
+      const Pending & p = pending.top();
+      push(p.tick, p.status, p.data1, p.data2);
+      pending.pop();
+    }
+  }
+
+public:
+  EventList events{};
+  unsigned cursor{};  //tick the next scripted event is relative to
+  size_t reallocations{};  //of events, counted when collectStats is set
+
+  //with notes, the notes are repaired as the events are added
+  explicit TrackScheduler(size_t expectedEvents = 0, NoteTable * notes = nullptr): notes(notes){
+    events.reserve(expectedEvents);
+  }
+
+  //an event at tick, which may not be earlier than the last one added
+  void add(unsigned tick, unsigned char status, unsigned char data1, unsigned char data2 = 0){
+    release(tick);
+    push(tick, status, data1, data2);
+  }
+  //an event at any later tick
+  void schedule(unsigned tick, unsigned char status, unsigned char data1, unsigned char data2 = 0){
+    pending.push(Pending{tick, order++, status, data1, data2});
+  }
+  //the events of pattern, starting at tick. nothing is added, and false is
+  //returned, if an event waiting would fall between them.
+  bool addPattern(unsigned tick, const EncodedPattern & pattern){
+    release(tick);
+    if(!pending.empty()) return false;
+    push(tick, 0x00, 0, 0);
+    events.patterns.push_back(&pattern);
+    lastTick = tick + pattern.span();
+    return true;
+  }
+  //release the events still waiting, the track lasts at least until the
+  //cursor. notes repaired that are still sounding end with it.
+  void finish(){
+    release(std::numeric_limits<unsigned>::max());
+    events.endTick = cursor;
+    if(notes){
+      unsigned end = std::max(cursor, lastTick);
+      notes->endAll([&](unsigned char status, unsigned char note){
+        events.push_back(end, status, note, 0);
+      });
+    }
+  }
+};
+
+
+//xoshiro256** random numbers, seeded with splitmix64. every track has its
+//own generator, so that tracks draw the same numbers on any thread.
+class Random{
+
+uint64_t state[4]{};
+
+  static uint64_t splitMix(uint64_t & x){
+    uint64_t z = (x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+  }
+
+public:
+  //generator number stream of the ones seeded with seed
+  Random(uint64_t seed, uint64_t stream){
+    uint64_t x = seed ^ splitMix(stream);
+    for(auto & s: state)
+      s = splitMix(x);
+  }
+  uint64_t next(){
+    uint64_t result = std::rotl(state[1] * 5, 7) * 9;
+    uint64_t t = state[1] << 17;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = std::rotl(state[3], 45);
+    return result;
+  }
+  //uniform in [0, n), without the bias of a modulo (lemire's method)
+  uint32_t below(uint32_t n){
+    uint64_t m = (next() >> 32) * n;
+    if(static_cast<uint32_t>(m) < n){
+      uint32_t threshold = -n % n;
+      while(static_cast<uint32_t>(m) < threshold)
+        m = (next() >> 32) * n;
+    }
+    return m >> 32;
+  }
+};
+
+//all the events of a track chunk body. with notes, the notes are repaired
+//as they are decoded.
+EventList decodeEvents(const unsigned char * data, size_t size, NoteTable * notes = nullptr);
+
+//check the structure of a track chunk body without decoding it: delta
+//times and lengths of at most 4 bytes, data bytes below 0x80, no data byte
+//without a status (meta and system exclusive events cancel running status),
+//payloads within the chunk, and an end of track ending it. the bytes are
+//classified 64 at a time with AVX2, SSE2 or plain 64-bit words, whichever
+//the cpu has. throws std::runtime_error with the offset of the first error.
+void validateTrack(const unsigned char * data, size_t size);
+
+//reshapes the events of a track before they are encoded. note numbers and
+//velocities are clamped to 0-127, the meta and system exclusive events only
+//move in time. ticks are stretched first, then quantized.
+struct EventTransform{
+  int transpose{};           //semitones added to the notes of note offs, note ons and key pressures
+  double velocityScale{1};   //note on velocities times this, at least 1 so they stay note ons
+  unsigned short fromDivision{}; //ticks are stretched from this division to toDivision.
+  unsigned short toDivision{};   //MidiBuilder fills fromDivision in with the division of what it writes
+  unsigned grid{};           //ticks rounded to the nearest multiple of this, 0 for none
+
+  bool stretches() const{
+    return fromDivision && toDivision && fromDivision != toDivision;
+  }
+  bool active() const{
+    return transpose || velocityScale != 1 || stretches() || grid > 1;
+  }
+};
+
+//transform events in place. the events are packed by field, so each
+//transform is one pass over one or two arrays, with AVX2 when the cpu has
+//it. patterns must have been expanded.
+void transformEvents(EventList & events, const EventTransform & transform);
+
+
+//a midi file mapped into memory. the chunks are walked in place, nothing
+//is copied to the heap.
+class MidiFileReader{
+
+const unsigned char * data{};
+size_t size{};
+
+  static unsigned bigEndian(const unsigned char * p, unsigned bytes){
+    unsigned n = 0;
+    for(unsigned i=0; i<bytes; i++)
+      n = (n << 8) | p[i];
+    return n;
+  }
+
+public:
+  struct Chunk{
+    const unsigned char * data;
+    size_t size;
+  };
+
+  //midi header info
+  unsigned short fileType{};
+  unsigned short numberOfTracks{};  //as declared in the header
+  unsigned short divisionTime{};
+  std::vector<Chunk> trackChunks{};  //MTrk bodies, in file order
+
+  explicit MidiFileReader(const std::string & path);
+  MidiFileReader(const MidiFileReader &) = delete;
+  MidiFileReader & operator=(const MidiFileReader &) = delete;
+  ~MidiFileReader();
+
+  EventReader events(size_t track) const{
+    return EventReader(trackChunks.at(track).data, trackChunks.at(track).size);
+  }
+};
+
+
+//how the tracks are encoded
+struct BuildOptions{
+  unsigned jobs{1};          //threads encoding tracks
+  bool runningStatus{false}; //leave out status bytes that repeat the previous one
+  bool verify{false};        //decode every track back and report its size
+  uint64_t seed{};           //of the random generators of the tracks
+  bool flatten{false};       //merge the tracks into the one track of a type 0 file
+  bool validate{false};      //check the structure of every track encoded
+  std::string cacheDirectory{}; //encoded tracks kept by a hash of what they are built from, empty for none
+  EventTransform transform{};   //applied to every track before it is encoded
+  bool repairNotes{false};   //merge overlapping notes, drop stray note-offs, end notes left sounding
+};
+
+//what building a track took, collected when collectStats is set. the
+//events of the track itself are counted by type, the ones of the patterns
+//it repeats together.
+struct TrackStats{
+  size_t notes{};             //of notes, chords and held notes
+  size_t arpeggioNotes{};
+  size_t programChanges{};
+  size_t controlChanges{};
+  size_t pitchWheelChanges{};
+  size_t rampSteps{};         //values sent by ramps
+  size_t patternEvents{};
+  size_t patternCopies{};     //repeats copied as encoded bytes
+  size_t reallocations{};     //of the event list and the track buffer
+  double buildSeconds{};      //script events to midi events
+  double encodeSeconds{};     //midi events to bytes
+};
+
+//what encoding a track produced
+struct TrackReport{
+  size_t events{};
+  size_t bytes{};         //chunk size, header included
+  size_t statusesLeftOut{};
+  bool cached{};          //copied from the cache directory instead of encoded
+  size_t notesMerged{};   //with repairNotes: note-ons of notes already sounding
+  size_t noteOffsDropped{};  //note-offs of notes not sounding
+  size_t notesEnded{};    //notes still sounding at the end
+  TrackStats stats{};
+};
+
+
+//encodes songs, or midi files read back, to a sink. tracks are encoded on
+//options.jobs threads, the file is the same for any number of them.
+class MidiBuilder{
+
+MidiSink & sink;
+BuildOptions options{};
+std::vector<TrackReport> reports{};
+
+//midi header info
+unsigned short fileType{};
+unsigned short numberOfTracks{};
+unsigned short divisionTime{};
+
+  //write a type 0 file, its one track merged from the track chunk bodies
+  void writeFlattened(const std::vector<MidiFileReader::Chunk> & chunks, const BuildOptions & options);
+
+  void buildMidiHeader();
+  //encode count tracks, track i with encode(i, trackBuffer, streamTo)
+  template<typename Encode>
+  void buildTracks(size_t count, Encode encode);
+
+public:
+  //events built at a time for a streamed track, as batchEvents of
+  //buildBatches. what a track takes in memory while it is streamed.
+  static constexpr size_t streamBatchEvents = 4096;
+
+  MidiBuilder(MidiSink & sink, const BuildOptions & options = {});
+
+  //write the header and the tracks of song. a type 0 song with several
+  //tracks, or any song with options.flatten, gets its tracks merged into one.
+  void write(const Song & song);
+  //write an existing file again, every track decoded and encoded anew
+  void write(const MidiFileReader & file);
+  //what the tracks written took, in file order
+  const std::vector<TrackReport> & trackReports() const{
+    return reports;
+  }
+
+  //options for the tracks of a song or file of divisionTime: with a
+  //stretch, fromDivision is filled in and divisionTime becomes the division
+  //written
+  static BuildOptions optionsFor(const BuildOptions & options, unsigned short & divisionTime);
+  //how many events a track makes, so that they are allocated at once. a
+  //pattern repeated counts once per time, as it is when its bytes are copied.
+  static size_t eventCount(const Track & track);
+  //encode track number index at the end of trackBuffer. when streamTo is set,
+  //trackBuffer is its buffer and is flushed while the track is encoded.
+  //patterns are the ones of the song the track repeats.
+  static TrackReport buildTrack(const Track & track, size_t index, std::vector<unsigned char> & trackBuffer,
+                                MidiSink * streamTo, const BuildOptions & options,
+                                std::span<const Track> patterns = {});
+  //the events of track number index, at absolute ticks and in the order
+  //buildTrack encodes them, built a batch of at least batchEvents events at
+  //a time (a script event, or a time a pattern is played, is built whole).
+  //track and patterns are used until the batches are done. with
+  //copyPatterns, the repeats of patterns that can be copied are status 0
+  //events, otherwise they are built as events. the notes repaired are
+  //counted in report, and what was built in report->stats by collectStats
+  //builds.
+  static EventBatches buildBatches(const Track & track, size_t index, BuildOptions options,
+                                   std::span<const Track> patterns = {}, bool copyPatterns = false,
+                                   size_t batchEvents = std::numeric_limits<size_t>::max(),
+                                   TrackReport * report = nullptr);
+  //buildTrack, unless options.cacheDirectory holds the chunk of a track
+  //built from the same events and options, which is then copied instead.
+  //a chunk encoded is added to the cache.
+  static TrackReport cachedTrack(const Track & track, size_t index, std::vector<unsigned char> & trackBuffer,
+                                 MidiSink * streamTo, const BuildOptions & options,
+                                 std::span<const Track> patterns = {});
+  //where the encoder is in a track, so that it can be encoded in batches
+  struct EncoderState{
+    unsigned time{};
+    unsigned char status{};  //running status, 0 for none
+    size_t payloadIndex{};
+    size_t payloadOffset{};
+    size_t patternIndex{};
+    size_t statusesLeftOut{};
+  };
+  //encode a track chunk of events at the end of trackBuffer. the exact size
+  //is computed first, so that trackBuffer grows once (or once per batch when
+  //streaming) and the events are written in place.
+  static TrackReport writeTrack(const EventList & events, std::vector<unsigned char> & trackBuffer, MidiSink * streamTo,
+                                const BuildOptions & options);
+  //encode a track chunk of events as they are built, to sink, so that only
+  //a batch of them is kept. trackBuffer is the buffer of sink.
+  static TrackReport streamTrack(EventBatches & batches, std::vector<unsigned char> & trackBuffer, MidiSink & sink,
+                                 const BuildOptions & options);
+  //merge track chunk bodies into one track chunk, streamed to sink. a
+  //min-heap holds the next event of every track, so merging N events of k
+  //tracks takes O(N log k), and only a batch of merged events is kept.
+  //events on the same tick keep the order of their tracks.
+  static TrackReport mergeTracks(const std::vector<MidiFileReader::Chunk> & chunks, MidiSink & sink,
+                                 const BuildOptions & options);
+  //encode events [first, last) at the end of buffer, grown by their exact size
+  static void appendEvents(const EventList & events, size_t first, size_t last, std::vector<unsigned char> & buffer,
+                           EncoderState & state, bool runningStatus);
+  //bytes writeEvents takes for events [first, last), starting from state
+  static size_t encodedSize(const EventList & events, size_t first, size_t last, EncoderState state,
+                            bool runningStatus);
+  //delta encode events [first, last) of a track to out, which has room for
+  //encodedSize of them. with running status, a status byte equal to the
+  //previous one is left out. returns the end of what was written.
+  static unsigned char * writeEvents(const EventList & events, size_t first, size_t last, unsigned char * out,
+                                     EncoderState & state, bool runningStatus);
+
+private:
+  //add the events of one script event to track, channel events on channelNumber
+  static void buildEvent(TrackScheduler & track, unsigned char & channelNumber, const TrackEvent & event,
+                         std::span<const unsigned char> noteNumbers, Random & random);
+  //plays pattern once. when its events can't interleave with others, the
+  //pattern encoded once for channelNumber is copied, otherwise its events
+  //are built again.
+  static void playPattern(TrackScheduler & track, unsigned char channelNumber, const Track & pattern,
+                          const EncodedPattern & encoded, Random & random);
+  //encode pattern on channelNumber, unless it draws random notes (those
+  //differ every time), its notes last past its end, or they need repairs
+  static void encodePattern(const Track & pattern, unsigned char channelNumber, EncodedPattern & encoded,
+                            const BuildOptions & options);
+  //events with the encoded patterns replaced by their events
+  static EventList expandPatterns(const EventList & events);
+  //count event, which added added events to the track
+  static void countEvent(TrackStats & stats, const TrackEvent & event, size_t added);
+  static void programChange(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event);
+  static void rampControlChange(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event);
+  static void rampPitchWheelChange(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event);
+  //value of a ramp at step (0 to event.steps)
+  static int rampValue(const TrackEvent & event, int step);
+  //sends the start value, then the steps of a ramp over event.rampDuration
+  //ticks. a step is only sent when its value (within mask) changes, so its
+  //delta time goes to the next step sent. with event.maxError or
+  //event.minInterval, a step is also left out when it is that close to the
+  //last value sent, or that soon after it. the end value is always sent.
+  template<typename Send>
+  static void ramp(TrackScheduler & track, const TrackEvent & event, int mask, Send send);
+  static void controlChange(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event);
+  static void pitchWheelChange(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event);
+  static void buildNotes(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event,
+                         std::span<const unsigned char> noteNumbers);
+  //the notes all start deltaTime after the previous event, and the next event
+  //is relative to their start, so they keep sounding while it plays
+  static void holdNotes(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event,
+                        std::span<const unsigned char> noteNumbers);
+  static void writeSimultaneousNotes(
+    TrackScheduler & track,
+    unsigned char channelNumber,
+    unsigned deltaTime,
+    unsigned duration,
+    unsigned velocity,
+    std::span<const unsigned char> noteNumbers);
+  //plays event.number notes, cycling through noteNumbers, or drawn from
+  //them in random order
+  static void arpeggio(TrackScheduler & track, unsigned char channelNumber, const TrackEvent & event,
+                       std::span<const unsigned char> noteNumbers, Random & random);
+};
+
+//build song into a midi file in memory
+std::vector<unsigned char> buildMidi(const Song & song, const BuildOptions & options = {});
+
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef STATICMIDI_HPP
+#define STATICMIDI_HPP
+
+#include "MidiBuilder.hpp"
+
+#include <array>
+#include <cstddef>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+
+//midi files built at compile time, for jingles and fixtures that never
+//change. the song is made by a lambda, with the same functions as at run
+//time:
+//
+//  constexpr auto jingle = staticMidi<[]{
+//    Song song{};
+//    song.addTrack().programChange(9).note(0, 240, 100, 72).note(0, 480, 100, 79);
+//    return song;
+//  }>();
+//
+//jingle is a std::array<std::byte, N> with the bytes buildMidi(song) makes.
+//the events have to come out in tick order as they are added: notes,
+//chords, rests, arpeggios in order, program, control, channel and pitch
+//wheel changes, and patterns. held notes, ramps, random arpeggios, a value
+//out of range or a type 0 song with several tracks stop the compilation.
+
+//encodes the events of a track straight to bytes, in the order they come
+class StaticTrackEncoder{
+
+std::vector<unsigned char> & out;
+unsigned delta{};  //ticks since the last event written
+unsigned char channelNumber{};
+
+  static constexpr unsigned char dataByte(unsigned value, const char * what){
+    if(value > 127) throw std::out_of_range(what);
+    return value;
+  }
+  constexpr void write(unsigned char status, unsigned char data1){
+    writeVarLen(out, delta);
+    delta = 0;
+    out.push_back(status | channelNumber);
+    out.push_back(data1);
+  }
+  constexpr void write(unsigned char status, unsigned char data1, unsigned char data2){
+    write(status, data1);
+    out.push_back(data2);
+  }
+  constexpr void notes(const TrackEvent & event, std::span<const unsigned char> noteNumbers){
+    unsigned char velocity = dataByte(event.velocity, "velocity above 127");
+    for(auto noteNumber: noteNumbers){
+      delta += event.deltaTime;
+      write(0x90, dataByte(noteNumber, "note number above 127"), velocity);
+    }
+    delta += event.duration;
+    for(auto noteNumber: noteNumbers)
+      write(0x90, noteNumber, 0x00);
+  }
+
+public:
+  explicit constexpr StaticTrackEncoder(std::vector<unsigned char> & out): out(out){}
+
+  //the events of track, or of a pattern, which can't repeat patterns
+  constexpr void add(const Track & track, std::span<const Track> patterns, bool pattern = false){
+    for(const auto & event: track.events){
+      auto noteNumbers = track.notes(event);
+      switch(event.kind){
+        case 1: case 2: case 3: case 4: notes(event, noteNumbers);break;
+        case 6: delta += event.deltaTime;break;
+        case 7:{
+          if(pattern) break;
+          if(event.number >= patterns.size()) throw std::out_of_range("pattern not defined");
+          //channel changes of the pattern end with it
+          unsigned char trackChannel = channelNumber;
+          delta += event.deltaTime;
+          for(unsigned i=0; i<event.times; i++){
+            add(patterns[event.number], patterns, true);
+            channelNumber = trackChannel;
+          }
+          break;
+        }
+        case 9:
+          if(event.arpMode == 1) throw std::runtime_error("random arpeggios are drawn at run time");
+          for(unsigned i=0; i<event.number && !noteNumbers.empty(); i++)
+            notes(event, noteNumbers.subspan(i % noteNumbers.size(), 1));
+          break;
+        case 10: write(0xc0, dataByte(event.number, "program number above 127"));break;
+        case 11:
+          delta += event.deltaTime;
+          write(0xb0, dataByte(event.number, "control number above 127"),
+                dataByte(event.value, "control value above 127"));
+          break;
+        case 12:
+          if(event.number > 15) throw std::out_of_range("channel number above 15");
+          channelNumber = event.number;
+          break;
+        case 13:
+          if(event.value > 0x3fff) throw std::out_of_range("pitch wheel value above 0x3FFF");
+          delta += event.deltaTime;
+          write(0xe0, event.value & 0x7f, event.value >> 7);
+          break;
+        case 5: case 20: case 21: case 22: case 23:
+          throw std::runtime_error("held notes and ramps are built at run time");
+        default: ;
+      }
+    }
+  }
+  //the end of track, after the rests left
+  constexpr void end(){
+    writeVarLen(out, delta);
+    out.insert(out.end(), {0xff, 0x2f, 0x00});
+  }
+};
+
+//the bytes of song, the same buildMidi(song) makes
+constexpr std::vector<unsigned char> buildStaticMidi(const Song & song){
+  if(song.fileType == 0 && song.tracks.size() > 1)
+    throw std::runtime_error("the tracks of a type 0 song are merged at run time");
+  if(song.tracks.size() > std::numeric_limits<unsigned short>::max())
+    throw std::runtime_error("more tracks than a midi file can hold");
+  auto header = midiHeader(song.fileType, song.tracks.size(), song.divisionTime);
+  std::vector<unsigned char> file(header.begin(), header.end());
+  for(const auto & track: song.tracks){
+    file.insert(file.end(), {'M', 'T', 'r', 'k', 0x00, 0x00, 0x00, 0x00});
+    size_t start = file.size();
+    StaticTrackEncoder encoder(file);
+    encoder.add(track, song.patterns);
+    encoder.end();
+    size_t length = file.size() - start;
+    for(unsigned i=0; i<4; i++)
+      file[start - 4 + i] = (length >> (24 - 8 * i)) & 0xff;
+  }
+  return file;
+}
+
+//the midi file of the song makeSong() returns, built by the compiler. its
+//size is found by building it once, then it is built into the array.
+template<auto makeSong>
+consteval auto staticMidi(){
+  constexpr size_t size = buildStaticMidi(makeSong()).size();
+  std::vector<unsigned char> bytes = buildStaticMidi(makeSong());
+  std::array<std::byte, size> file{};
+  for(size_t i=0; i<size; i++)
+    file[i] = std::byte{bytes[i]};
+  return file;
+}
+
+
+#endif
@@ -1,624 +1,2492 @@
+#include "MidiBuilder.hpp"
+
 #include <iostream>
-#include <vector>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
 #include <ctime>
+#include <chrono>
+#include <thread>
+#include <atomic>
 #include <array>
+#include <bit>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <semaphore>
+#include <future>
+#include <functional>
+#include <new>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 
-std::array<unsigned char, 4> uintTo7bits(unsigned int n){
-  std::array<unsigned char, 4> result{};
-  result.at(3) = (n & 0b00000000000000000000000001111111)      ;
-  result.at(2) = (n & 0b00000000000000000011111110000000) >> 7 ;
-  result.at(1) = (n & 0b00000000000111111100000000000000) >> 14;
-  result.at(0) = (n & 0b00001111111000000000000000000000) >> 21;
-  return result;
+//allocations made so far, counted for the benchmarks in a build with
+//-DMIDIBUILDER_BENCH. without it --bench isn't available, and the other
+//modes keep the allocator of the library.
+#ifdef MIDIBUILDER_BENCH
+constexpr bool benchmarks = true;
+std::atomic<size_t> allocationCount{0};
+
+void * operator new(size_t size){
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  if(void * p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void * p) noexcept{
+  std::free(p);
+}
+[[gnu::noinline]] void operator delete(void * p, size_t) noexcept{
+  std::free(p);
+}
+#else
+constexpr bool benchmarks = false;
+constexpr size_t allocationCount = 0;
+#endif
+
+
+//error in a batch script, with the position of the offending token
+class ScriptError: public std::runtime_error{
+public:
+  unsigned line{};
+  unsigned column{};
+  ScriptError(const std::string & message, unsigned line, unsigned column)
+    : std::runtime_error(message), line(line), column(column){}
+};
+
+
+//binary scripts start with these 4 bytes, then the version as a varint
+constexpr char binaryScriptMagic[4] = {'M', 'B', 's', 'c'};
+constexpr unsigned binaryScriptVersion = 1;
+
+//source of the script fields.
+//interactive: every field is prompted for and extracted from std::cin.
+//batch: the whole script is held in memory and tokenized in place, no prompts.
+//binary: a batch script of varints (see README.md), errors are at line 1
+//and the byte offset as the column.
+class ScriptReader{
+
+bool batch{false};
+bool binary{false};
+std::string script{};     //when the reader owns the script
+const char * pos{};
+const char * end{};
+const char * lineStart{};
+const char * token{};
+unsigned line{1};
+
+  //skip whitespace and # comments, keeping track of the line
+  void skipBlanks(){
+    while(pos != end){
+      char c = *pos;
+      if(c == '\n'){
+        line++;
+        lineStart = ++pos;
+      }
+      else if(c == ' ' || c == '\t' || c == '\r'){
+        pos++;
+      }
+      else if(c == '#'){
+        while(pos != end && *pos != '\n') pos++;
+      }
+      else break;
+    }
+  }
+  [[noreturn]] void fail(const std::string & message, const char * at) const{
+    throw ScriptError(message, line, static_cast<unsigned>(at - lineStart) + 1);
+  }
+  //parse the next decimal token, without allocating
+  long long nextNumber(){
+    skipBlanks();
+    if(pos == end) fail("unexpected end of script", pos);
+    const char * start = token = pos;
+    bool negative = false;
+    if(*pos == '-'){
+      negative = true;
+      pos++;
+    }
+    unsigned long long value = 0;
+    const char * digits = pos;
+    while(pos != end && static_cast<unsigned char>(*pos - '0') < 10){
+      value = value * 10 + (*pos - '0');
+      if(value > 0xFFFFFFFFull) fail("number out of range", start);
+      pos++;
+    }
+    if(pos == digits || (pos != end && !isBlank(*pos)))
+      fail("expected a number", start);
+    return negative ? -static_cast<long long>(value) : value;
+  }
+  static bool isBlank(char c){
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '#';
+  }
+  //parse the next LEB128 varint: 7 bits per byte, lowest first, the high
+  //bit set on all bytes but the last
+  unsigned long long nextVarint(){
+    const char * start = token = pos;
+    unsigned long long value = 0;
+    for(unsigned shift = 0; ; shift += 7){
+      if(pos == end) fail("unexpected end of script", start);
+      unsigned char c = *pos++;
+      value |= static_cast<unsigned long long>(c & 0x7f) << shift;
+      if(value > 0xFFFFFFFFull || shift > 28) fail("number out of range", start);
+      if(!(c & 0x80)) return value;
+    }
+  }
+  void start(const char * data, size_t size){
+    pos = lineStart = data;
+    end = data + size;
+    if(size >= 4 && std::memcmp(data, binaryScriptMagic, 4) == 0){
+      binary = true;
+      pos += 4;
+      if(nextVarint() != binaryScriptVersion) fail("unsupported binary script version", token);
+    }
+  }
+
+public:
+  ScriptReader() = default;
+  explicit ScriptReader(std::string text)
+    : batch(true), script(std::move(text)){
+    start(script.data(), script.size());
+  }
+  //a script held elsewhere (a mapped file), which must outlive the reader
+  explicit ScriptReader(std::string_view text)
+    : batch(true){
+    start(text.data(), text.size());
+  }
+  ScriptReader(const ScriptReader &) = delete;
+  ScriptReader & operator=(const ScriptReader &) = delete;
+
+  bool isBatch() const{
+    return batch;
+  }
+  template<typename T>
+  T read(const char * prompt){
+    static_assert(std::is_integral<T>::value, "script fields are integers");
+    if(!batch){
+      T value{};
+      std::cout << prompt;
+      std::cin >> value;
+      return value;
+    }
+    long long value{};
+    if(!binary){
+      value = nextNumber();
+    }
+    else if constexpr(std::is_signed<T>::value){
+      //zigzag: 0, -1, 1, -2, ... as 0, 1, 2, 3, ...
+      unsigned long long zigzag = nextVarint();
+      value = static_cast<long long>(zigzag >> 1) ^ -static_cast<long long>(zigzag & 1);
+    }
+    else{
+      value = nextVarint();
+    }
+    if(value < static_cast<long long>(std::numeric_limits<T>::min()) ||
+       value > static_cast<long long>(std::numeric_limits<T>::max()))
+      fail("number out of range", token);
+    return static_cast<T>(value);
+  }
+  //interactive mode asks again until the value is valid, batch mode fails
+  template<typename T>
+  T read(const char * prompt, T max, const char * retryPrompt){
+    return read<T>(prompt, std::numeric_limits<T>::min(), max, retryPrompt);
+  }
+  template<typename T>
+  T read(const char * prompt, T min, T max, const char * retryPrompt){
+    T value = read<T>(prompt);
+    if(batch){
+      if(value < min)
+        fail("value must be at least " + std::to_string(min), token);
+      if(value > max)
+        fail("value must be at most " + std::to_string(max), token);
+      return value;
+    }
+    while(value < min || value > max){
+      std::cout << retryPrompt;
+      std::cin >> value;
+    }
+    return value;
+  }
+  //the field just read can't be used: batch mode fails at it, interactive
+  //mode says why and goes on
+  void reject(const std::string & message){
+    if(batch) fail(message, token);
+    std::cout << message << std::endl;
+  }
+  //prompt for the index-th item of a list
+  template<typename T>
+  T read(unsigned index, const char * prompt){
+    if(!batch)
+      std::cout << index;
+    return read<T>(prompt);
+  }
+  std::string readWord(const char * prompt){
+    std::string word{};
+    if(!batch){
+      std::cout << prompt;
+      std::cin >> word;
+      return word;
+    }
+    if(binary){
+      //its length, then its bytes
+      size_t length = nextVarint();
+      if(size_t(end - pos) < length) fail("unexpected end of script", token);
+      word.assign(pos, pos + length);
+      pos += length;
+      return word;
+    }
+    skipBlanks();
+    if(pos == end) fail("unexpected end of script", pos);
+    token = pos;
+    while(pos != end && !isBlank(*pos)) pos++;
+    word.assign(token, pos);
+    return word;
+  }
+};
+
+
+//read a whole script file, or stdin when path is "-"
+std::string readScript(const std::string & path){
+  std::string text{};
+  if(path == "-"){
+    char block[1 << 16];
+    size_t n;
+    while((n = std::fread(block, 1, sizeof block, stdin)) > 0)
+      text.append(block, n);
+    return text;
+  }
+  std::ifstream file(path, std::ios::binary);
+  if(!file) throw std::runtime_error("cannot open " + path);
+  file.seekg(0, std::ios::end);
+  text.resize(static_cast<size_t>(file.tellg()));
+  file.seekg(0, std::ios::beg);
+  file.read(&text[0], text.size());
+  return text;
 }
 
 
-class MidiBuilder{
+//a script file mapped into memory, so that it is parsed in place. stdin
+//("-"), and files that can't be mapped (pipes), are read into memory.
+class ScriptFile{
+
+std::string text{};
+const char * data{};
+size_t size{};
+bool mapped{false};
+
+public:
+  explicit ScriptFile(const std::string & path){
+    int fd = path == "-" ? -1 : ::open(path.c_str(), O_RDONLY);
+    struct stat info{};
+    if(fd >= 0 && ::fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0){
+      void * map = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(map != MAP_FAILED){
+        ::madvise(map, info.st_size, MADV_SEQUENTIAL);
+        data = static_cast<const char *>(map);
+        size = info.st_size;
+        mapped = true;
+      }
+    }
+    if(fd >= 0) ::close(fd);
+    if(!mapped){
+      text = readScript(path);
+      data = text.data();
+      size = text.size();
+    }
+  }
+  ScriptFile(const ScriptFile &) = delete;
+  ScriptFile & operator=(const ScriptFile &) = delete;
+  ~ScriptFile(){
+    if(mapped) ::munmap(const_cast<char *>(data), size);
+  }
+  std::string_view view() const{
+    return {data, size};
+  }
+};
+
 
-std::string filename{};
-std::ofstream midiFile{};
-std::vector<char> midiBuffer{};
+//reads a song, and the name to save it as, from a script. in interactive
+//mode every field is prompted for.
+class ScriptParser{
 
-//midi header info
-unsigned short fileType{};
-unsigned short numberOfTracks{};
-unsigned short divisionTime{};
+ScriptReader * input{};
 
 public:
-  MidiBuilder(){
+  Song song{};
+  std::string filename{};
+
+  explicit ScriptParser(ScriptReader & input): input(&input){
     askType();
     askTracks();
     askTime();
-    buildMidiHeader();
-    buildTracks();
-    saveMidiFile();
+    readTracks();
+    askFilename();
   }
-  void saveMidiFile(){
-    std::cout << "Save As?" << std::endl
-              << "  > ";
-    std::cin >> filename;
-    midiFile.open(filename, std::ios::binary);
-    for(auto c: midiBuffer){
-      midiFile.write(reinterpret_cast<char *>(&c), 1);
-    }
+
+private:
+  void askFilename(){
+    filename = input->readWord("Save As?\n"
+                              "  > ");
   }
   void askTime(){
-    std::cout << "How many ticks per quarter note?" << std::endl
-              << "  > ";
-    std::cin >> divisionTime;
+    song.divisionTime = input->read<unsigned short>("How many ticks per quarter note?\n"
+                                                   "  > ");
   }
   void askType(){
-    std::cout << "What type of MIDI file would you like to create?"
-              << std::endl
-              << "  0 = 1 track " << std::endl
-              << "  1 = Multiple parallel tracks" << std::endl
-              << "  2 = Multiple sequential tracks" << std::endl
-              << "  > " ;
-    std::cin >> fileType;
-    while(fileType > 2){
-      std::cout << "Enter a valid MIDI file type (0, 1 or 2)"
-                << std::endl;
-      std::cin >> fileType;
-    }
+    song.fileType = input->read<unsigned short>(
+      "What type of MIDI file would you like to create?\n"
+      "  0 = 1 track \n"
+      "  1 = Multiple parallel tracks\n"
+      "  2 = Multiple sequential tracks\n"
+      "  > ",
+      2,
+      "Enter a valid MIDI file type (0, 1 or 2)\n");
   }
   void askTracks(){
-    std::cout << "How many tracks will this file contain?" << std::endl
-              << "  > ";
-    std::cin >> numberOfTracks;
-  }
-  void buildMidiHeader(){
-    //header chunk magick
-    for(const auto c: {'M','T','h','d'})
-      midiBuffer.push_back(c);
-
-    //header chunk length, always 6
-    for(const auto c: {0x00,0x00,0x00,0x06})
-      midiBuffer.push_back(c);
-
-    //midi file type
-    unsigned char high = (fileType & 0xFF00) >> 8 ;
-    unsigned char low = fileType & 0x00FF ;
-    midiBuffer.push_back(high);
-    midiBuffer.push_back(low);
-
-    //midi file number of tracks
-    high = (numberOfTracks & 0xFF00) >> 8 ;
-    low = numberOfTracks & 0x00FF ;
-    midiBuffer.push_back(high);
-    midiBuffer.push_back(low);
-
-    //midi file division time
-    high = (divisionTime & 0xFF00) >> 8 ;
-    low = divisionTime & 0x00FF ;
-    midiBuffer.push_back(high);
-    midiBuffer.push_back(low);
-  }
-  void buildTracks(){
-    for(unsigned short i=0;i<numberOfTracks;i++){
-      std::cout << "Building Track " << i << std::endl;
-      buildTrack();
-    }
-  }
-  void buildTrack(){
-    unsigned char programNumber{0}; //0-127
-    unsigned char channelNumber{0}; //0-15
-
-    std::vector<unsigned char> trackBuffer{};
-
-    //header chunk magick
-    for(const auto c: {'M','T','r','k'})
-      trackBuffer.push_back(c);
-
-    //header chunk length, leave at zero value for now but will change later
-    for(const auto c: {0x00,0x00,0x00,0x00})
-      trackBuffer.push_back(c);
-
-    //events
+    unsigned short numberOfTracks = input->read<unsigned short>("How many tracks will this file contain?\n"
+                                                               "  > ");
+    song.tracks.resize(numberOfTracks);
+  }
+  void readTracks(){
+    for(size_t i=0;i<song.tracks.size();i++){
+      if(!input->isBatch())
+        std::cout << "Building Track " << i << std::endl;
+      askTrack(song.tracks[i]);
+    }
+  }
+  //the events of a track, or of a pattern, which can't repeat or define
+  //patterns itself
+  void askTrack(Track & track, bool pattern = false){
     unsigned eventSelection{};
     do{
-      eventSelection = 0;
-      std::cout << "Would you like to add an event?" << std::endl
-                << "  0 - No. (End the Track)" << std::endl
-                << "  1 - One note" << std::endl
-                << "  2 - Two simultaneous notes" << std::endl
-                << "  3 - Three simultaneous notes" << std::endl
-                << "  4 - Four simultaneous notes" << std::endl
-                << "  9 - Arpeggio" << std::endl
-                << " 10 - Program change" << std::endl
-                << " 11 - Control change" << std::endl
-                << " 12 - Channel change" << std::endl
-                << " 13 - Pitch wheel change" << std::endl
-                << " 20 - Ramp control change" << std::endl
-                << " 21 - Ramp pitch wheel change" << std::endl
-                << "  > ";
-      std::cin >> eventSelection;
+      eventSelection = input->read<unsigned>(
+        "Would you like to add an event?\n"
+        "  0 - No. (End the Track)\n"
+        "  1 - One note\n"
+        "  2 - Two simultaneous notes\n"
+        "  3 - Three simultaneous notes\n"
+        "  4 - Four simultaneous notes\n"
+        "  5 - Held notes (the next event starts while they sound)\n"
+        "  6 - Rest (wait before the next event)\n"
+        "  7 - Repeat a pattern\n"
+        "  8 - Define a pattern (its events, then 0)\n"
+        "  9 - Arpeggio\n"
+        " 10 - Program change\n"
+        " 11 - Control change\n"
+        " 12 - Channel change\n"
+        " 13 - Pitch wheel change\n"
+        " 20 - Ramp control change\n"
+        " 21 - Ramp pitch wheel change\n"
+        " 22 - Shaped ramp control change\n"
+        " 23 - Shaped ramp pitch wheel change\n"
+        "  > ");
+      TrackEvent event{};
+      event.kind = eventSelection;
       switch(eventSelection){
-        case 1: buildNotes(trackBuffer, channelNumber, 1);break;
-        case 2: buildNotes(trackBuffer, channelNumber, 2);break;
-        case 3: buildNotes(trackBuffer, channelNumber, 3);break;
-        case 4: buildNotes(trackBuffer, channelNumber, 4);break;
-        case 9: arpeggio(trackBuffer, channelNumber);break;
-        case 10: programChange(trackBuffer, channelNumber);break;
-        case 11: controlChange(trackBuffer, channelNumber);break;
-        case 12: channelChange(channelNumber);break;
-        case 13: pitchWheelChange(trackBuffer, channelNumber);break;
-        case 20: rampControlChange(trackBuffer, channelNumber);break;
-        case 21: rampPitchWheelChange(trackBuffer, channelNumber);break;
-        default: ;
+        case 1: case 2: case 3: case 4: askNotes(track, event, eventSelection);break;
+        case 5: askHeldNotes(track, event);break;
+        case 6: event.deltaTime = askDeltaTime();break;
+        case 7: case 8:
+          if(pattern){
+            input->reject("a pattern can't repeat or define patterns");
+            continue;
+          }
+          if(eventSelection == 8){
+            askPattern();
+            continue;
+          }
+          if(song.patterns.empty()){
+            input->reject("no pattern is defined yet");
+            continue;
+          }
+          askRepeat(event);
+          break;
+        case 9: askArpeggio(track, event);break;
+        case 10: askProgramChange(event);break;
+        case 11: askControlChange(event);break;
+        case 12: askChannelChange(event);break;
+        case 13: askPitchWheelChange(event);break;
+        case 20: askRampControlChange(event);break;
+        case 21: askRampPitchWheelChange(event);break;
+        case 22: askRampControlChange(event);askRampShape(event);break;
+        case 23: askRampPitchWheelChange(event);askRampShape(event);break;
+        default: continue;
       }
+      track.events.push_back(std::move(event));
     }while(eventSelection);
-
-    //end of track
-    for(const auto c: {0x00, 0xff, 0x2f, 0x00})
-      trackBuffer.push_back(c);
-    std::cout << "End of track" << std::endl;
-
-    //adjust length of track (byte 4-7 in the buffer)
-    unsigned int trackLength = trackBuffer.size() - 8;
-    trackBuffer.at(4) = (trackLength & 0xff000000) >> 24;
-    trackBuffer.at(5) = (trackLength & 0x00ff0000) >> 16;
-    trackBuffer.at(6) = (trackLength & 0x0000ff00) >> 8;
-    trackBuffer.at(7) = (trackLength & 0x000000ff) ;
-
-    //load track buffer into midibuffer
-    for(auto c: trackBuffer)
-      midiBuffer.push_back(c);
-  }
-  void programChange(std::vector<unsigned char> & trackBuffer, unsigned char channelNumber){
-    unsigned char programNumber{}; //0-127
-    std::cout << "What is the program/instrument number? (0-127)" << std::endl << "  > ";
-    unsigned pn{};
-    std::cin >> pn;
-    while(pn > 127){
-      std::cout << "Enter a valid program number (0-127)" << std::endl
-                << "  > ";
-      std::cin >> pn;
-    }
-    programNumber = pn & 0x000000ff;
-    for(const auto c: {0x00, 0xc0 + channelNumber})
-      trackBuffer.push_back(c);
-    trackBuffer.push_back(programNumber);
-  }
-  void channelChange(unsigned char & channelNumber){
-    std::cout << "What is the channel number?" << std::endl << "  > ";
-    unsigned cn{};
-    std::cin >> cn;
-    while(cn > 15){
-      std::cout << "Enter a valid channel number (0-15)" << std::endl
-                << "  > ";
-      std::cin >> cn;
-    }
-    channelNumber = cn & 0x000000ff;
-  }
-  void rampControlChange(std::vector<unsigned char> & trackBuffer, unsigned char channelNumber){
-    unsigned char controlNumber{}; //0-127
-    std::cout << "What is the control number?" << std::endl << "  > ";
-    unsigned cn{};
-    std::cin >> cn;
-    controlNumber = cn & 0x000000ff;
-
-    unsigned deltaTime{};
-    std::cout << "What is the delta time?" << std::endl
-              << "  > ";
-    std::cin >> deltaTime;
-    std::array<unsigned char, 4> deltaTimeArr = uintTo7bits(deltaTime);
-
+    if(!input->isBatch())
+      std::cout << (pattern ? "End of pattern" : "End of track") << std::endl;
+  }
+  //patterns are numbered in the order they are defined
+  void askPattern(){
+    if(!input->isBatch())
+      std::cout << "Building Pattern " << song.patterns.size() << std::endl;
+    askTrack(song.addPattern(), true);
+  }
+  //after a pattern is defined
+  void askRepeat(TrackEvent & event){
+    event.number = input->read<unsigned>("Which pattern?\n"
+                                        "  > ",
+                                        static_cast<unsigned>(song.patterns.size() - 1),
+                                        "Enter a defined pattern number\n"
+                                        "  > ");
+    event.deltaTime = askDeltaTime();
+    event.times = input->read<unsigned>("How many times in a row?\n"
+                                       "  > ");
+  }
+  unsigned askDeltaTime(){
+    return input->read<unsigned>("What is the delta time?\n"
+                                "  > ",
+                                maxVarLen,
+                                "Enter a valid delta time (0-0x0FFFFFFF)\n"
+                                "  > ");
+  }
+  void askNoteNumbers(Track & track, TrackEvent & event, unsigned numberOfNotes){
+    event.firstNote = track.noteNumbers.size();
+    event.noteCount = numberOfNotes;
+    for(unsigned i=0; i<numberOfNotes; i++)
+    {
+      unsigned noteNumber = input->read<unsigned>(i, " - What is the note number?(0-127)\n"
+                                                    "  > ");
+      track.noteNumbers.push_back(noteNumber);
+    }
+  }
+  void askProgramChange(TrackEvent & event){
+    event.number = input->read<unsigned>("What is the program/instrument number? (0-127)\n"
+                                        "  > ",
+                                        127u,
+                                        "Enter a valid program number (0-127)\n"
+                                        "  > ");
+  }
+  void askChannelChange(TrackEvent & event){
+    event.number = input->read<unsigned>("What is the channel number?\n"
+                                        "  > ",
+                                        15u,
+                                        "Enter a valid channel number (0-15)\n"
+                                        "  > ");
+  }
+  void askRamp(TrackEvent & event){
 //what is the start value?
-    int startValue{};
-    std::cout << "What is the start value?" << std::endl
-              << "  > ";
-    std::cin >> startValue;;
+    event.startValue = input->read<int>("What is the start value?\n"
+                                       "  > ");
 //what is the end value?
-    int endValue{};
-    std::cout << "What is the end value?" << std::endl
-              << "  > ";
-    std::cin >> endValue;;
+    event.endValue = input->read<int>("What is the end value?\n"
+                                     "  > ");
 //what is the duration of the ramp?
-    int duration{};
-    std::cout << "What is the ramp duration?" << std::endl
-              << "  > ";
-    std::cin >> duration;
+    event.rampDuration = input->read<int>("What is the ramp duration?\n"
+                                         "  > ",
+                                         0,
+                                         static_cast<int>(maxVarLen),
+                                         "Enter a valid ramp duration (0-0x0FFFFFFF)\n"
+                                         "  > ");
 //how many steps/divisions in the ramp? (minimum 1)
-    int steps{};
-    std::cout << "How many steps in the ramp?" << std::endl
-              << "  > ";
-    std::cin >> steps;
+    event.steps = input->read<int>("How many steps in the ramp?\n"
+                                  "  > ");
+  }
+  void askRampControlChange(TrackEvent & event){
+    event.number = input->read<unsigned>("What is the control number?\n"
+                                        "  > ");
+    event.deltaTime = askDeltaTime();
+    askRamp(event);
+  }
+  void askRampPitchWheelChange(TrackEvent & event){
+    event.deltaTime = askDeltaTime();
+    askRamp(event);
+  }
+  void askRampShape(TrackEvent & event){
+    event.shape = input->read<unsigned>("What is the shape of the ramp?\n"
+                                       "  0 - Linear\n"
+                                       "  1 - Exponential\n"
+                                       "  2 - S-curve\n"
+                                       "  > ",
+                                       2u,
+                                       "Enter a valid shape (0, 1 or 2)\n"
+                                       "  > ");
+    event.maxError = input->read<unsigned>("How far from the curve can the value stay? (0 for exact)\n"
+                                          "  > ");
+    event.minInterval = input->read<unsigned>("How many ticks at least between two values?\n"
+                                             "  > ");
+  }
+  void askControlChange(TrackEvent & event){
+    event.deltaTime = askDeltaTime();
+    event.number = input->read<unsigned>("What is the control number?\n"
+                                        "  > ");
+    event.value = input->read<unsigned>("What is the control value?\n"
+                                       "  > ");
+  }
+  void askPitchWheelChange(TrackEvent & event){
+    event.deltaTime = askDeltaTime();
+    event.value = input->read<unsigned>("What is the Pitch Wheel value? (0-0x3FFF)\n"
+                                       "  > "); //0-0x4000
+  }
+  void askNoteTiming(TrackEvent & event){
+    event.deltaTime = askDeltaTime();
+    event.duration = input->read<unsigned>("What is the duration?\n"
+                                          "  > ",
+                                          maxVarLen,
+                                          "Enter a valid duration (0-0x0FFFFFFF)\n"
+                                          "  > ");
+    event.velocity = input->read<unsigned>("What is the velocity?(0-127)\n"
+                                          "  > ");
+  }
+  void askNotes(Track & track, TrackEvent & event, unsigned numberOfNotes){
+    askNoteTiming(event);
+    askNoteNumbers(track, event, numberOfNotes);
+  }
+  void askHeldNotes(Track & track, TrackEvent & event){
+    askNoteTiming(event);
+    unsigned numberOfNotes = input->read<unsigned>("How many notes?\n"
+                                                  "  > ");
+    askNoteNumbers(track, event, numberOfNotes);
+  }
+  void askArpeggio(Track & track, TrackEvent & event){
+    askNoteTiming(event);
+    event.number = input->read<unsigned>("How many notes to play?\n"
+                                        "  > ");
+    unsigned numberOfNoteNumbers = input->read<unsigned>("How many note numbers?\n"
+                                                        "  > ");
+    unsigned arpMode = input->read<unsigned>("How to arpeggiate the notes?\n" //order vs random
+                                            "  0 - In order\n"
+                                            "  1 - In random order\n"
+                                            "  > ");
+    askNoteNumbers(track, event, numberOfNoteNumbers);
+    if(arpMode > 1){
+      event.number = 0;
+    }
+    event.arpMode = arpMode;
+  }
+};
+
+
+//writes the fields of a script, as text (an event per line) or binary
+class ScriptWriter{
+
+std::ostream & out;
+bool binary{false};
+bool lineStarted{false};
+
+  void varint(unsigned long long value){
+    char bytes[10];
+    unsigned n = 0;
+    do{
+      bytes[n++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+      value >>= 7;
+    }while(value);
+    out.write(bytes, n);
+  }
+
+public:
+  ScriptWriter(std::ostream & out, bool binary): out(out), binary(binary){
+    if(binary){
+      out.write(binaryScriptMagic, 4);
+      varint(binaryScriptVersion);
+    }
+  }
+  void number(unsigned long long value){
+    if(binary) return varint(value);
+    out << (lineStarted ? " " : "") << value;
+    lineStarted = true;
+  }
+  void signedNumber(long long value){
+    if(binary) return varint(static_cast<unsigned long long>(value) << 1 ^ -static_cast<unsigned long long>(value < 0));
+    out << (lineStarted ? " " : "") << value;
+    lineStarted = true;
+  }
+  void word(const std::string & text){
+    if(binary){
+      varint(text.size());
+      out.write(text.data(), text.size());
+      return;
+    }
+    out << (lineStarted ? " " : "") << text;
+    lineStarted = true;
+  }
+  void endLine(){
+    if(!binary && lineStarted) out << '\n';
+    lineStarted = false;
+  }
+};
+
+//the fields of the events of track, in the order ScriptParser reads them.
+//patterns, when given, are defined first.
+void writeScriptTrack(ScriptWriter & out, const Track & track, std::span<const Track> patterns = {}){
+  for(const auto & pattern: patterns){
+    out.number(8);
+    out.endLine();
+    writeScriptTrack(out, pattern);
+  }
+  for(const auto & event: track.events){
+    out.number(event.kind);
+    switch(event.kind){
+      case 1: case 2: case 3: case 4: case 5: case 9:
+        out.number(event.deltaTime);
+        out.number(event.duration);
+        out.number(event.velocity);
+        if(event.kind == 5) out.number(event.noteCount);
+        if(event.kind == 9){
+          out.number(event.number);
+          out.number(event.noteCount);
+          out.number(event.arpMode);
+        }
+        for(unsigned char note: track.notes(event))
+          out.number(note);
+        break;
+      case 6: out.number(event.deltaTime);break;
+      case 7: out.number(event.number);out.number(event.deltaTime);out.number(event.times);break;
+      case 10: case 12: out.number(event.number);break;
+      case 11: out.number(event.deltaTime);out.number(event.number);out.number(event.value);break;
+      case 13: out.number(event.deltaTime);out.number(event.value);break;
+      case 20: case 21: case 22: case 23:
+        if(event.kind == 20 || event.kind == 22) out.number(event.number);
+        out.number(event.deltaTime);
+        out.signedNumber(event.startValue);
+        out.signedNumber(event.endValue);
+        out.signedNumber(event.rampDuration);
+        out.signedNumber(event.steps);
+        if(event.kind >= 22){
+          out.number(event.shape);
+          out.number(event.maxError);
+          out.number(event.minInterval);
+        }
+        break;
+      default: ;
+    }
+    out.endLine();
+  }
+  out.number(0);
+  out.endLine();
+}
+
+//a script that reads back as song, saved as filename. the patterns are
+//defined at the start of the first track.
+void writeScript(ScriptWriter & out, const Song & song, const std::string & filename){
+  out.number(song.fileType);
+  out.endLine();
+  out.number(song.tracks.size());
+  out.endLine();
+  out.number(song.divisionTime);
+  out.endLine();
+  for(size_t i=0; i<song.tracks.size(); i++)
+    writeScriptTrack(out, song.tracks[i], i == 0 ? std::span<const Track>(song.patterns) : std::span<const Track>{});
+  out.word(filename);
+  out.endLine();
+}
 
-///
 
-      if(deltaTimeArr.at(0)){
-      trackBuffer.push_back(deltaTimeArr.at(0) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+//print what the tracks took, with and without running status
+void printReport(const std::string & name, const TrackReport & report){
+  size_t withoutRunningStatus = report.bytes + report.statusesLeftOut;
+  std::cerr << name << ": " << report.events << " events, "
+            << report.bytes << " bytes, "
+            << withoutRunningStatus << " without running status";
+  if(withoutRunningStatus)
+    std::cerr << " (" << 100.0 * report.statusesLeftOut / withoutRunningStatus << "% saved)";
+  if(report.cached)
+    std::cerr << ", cached";
+  if(report.notesMerged || report.noteOffsDropped || report.notesEnded)
+    std::cerr << ", notes repaired: " << report.notesMerged << " merged, "
+              << report.noteOffsDropped << " note-offs dropped, " << report.notesEnded << " ended";
+  std::cerr << std::endl;
+}
+TrackReport totalReport(const std::vector<TrackReport> & reports){
+  TrackReport total{};
+  for(const auto & report: reports){
+    total.events += report.events;
+    total.bytes += report.bytes;
+    total.statusesLeftOut += report.statusesLeftOut;
+    total.notesMerged += report.notesMerged;
+    total.noteOffsDropped += report.noteOffsDropped;
+    total.notesEnded += report.notesEnded;
+  }
+  return total;
+}
+void printReports(const std::vector<TrackReport> & reports){
+  for(size_t i=0; i<reports.size(); i++)
+    printReport("track " + std::to_string(i), reports[i]);
+  printReport("all tracks", totalReport(reports));
+}
+//what --repair-notes changed in the tracks
+void printRepairs(const std::vector<TrackReport> & reports){
+  TrackReport total = totalReport(reports);
+  std::cerr << total.notesMerged << " overlapping note-ons merged, "
+            << total.noteOffsDropped << " stray note-offs dropped, "
+            << total.notesEnded << " notes left sounding ended" << std::endl;
+}
+
+//the counters and timers of a build as json, on one line per track. the
+//build and encode times add up the tracks, which may have run in parallel.
+void printStats(std::ostream & out, double parseSeconds, double totalSeconds,
+                const std::vector<TrackReport> & reports, const SinkStats & sink){
+  TrackStats total{};
+  size_t events = 0;
+  size_t bytes = 0;
+  for(const auto & report: reports){
+    const TrackStats & s = report.stats;
+    total.notes += s.notes;
+    total.arpeggioNotes += s.arpeggioNotes;
+    total.programChanges += s.programChanges;
+    total.controlChanges += s.controlChanges;
+    total.pitchWheelChanges += s.pitchWheelChanges;
+    total.rampSteps += s.rampSteps;
+    total.patternEvents += s.patternEvents;
+    total.patternCopies += s.patternCopies;
+    total.reallocations += s.reallocations;
+    total.buildSeconds += s.buildSeconds;
+    total.encodeSeconds += s.encodeSeconds;
+    events += report.events;
+    bytes += report.bytes;
+  }
+  out << "{\"parseSeconds\": " << parseSeconds
+      << ", \"buildSeconds\": " << total.buildSeconds
+      << ", \"encodeSeconds\": " << total.encodeSeconds
+      << ", \"writeSeconds\": " << sink.writeSeconds
+      << ", \"totalSeconds\": " << totalSeconds << ",\n"
+      << " \"events\": " << events
+      << ", \"notes\": " << total.notes
+      << ", \"arpeggioNotes\": " << total.arpeggioNotes
+      << ", \"programChanges\": " << total.programChanges
+      << ", \"controlChanges\": " << total.controlChanges
+      << ", \"pitchWheelChanges\": " << total.pitchWheelChanges
+      << ", \"rampSteps\": " << total.rampSteps
+      << ", \"patternEvents\": " << total.patternEvents
+      << ", \"patternCopies\": " << total.patternCopies << ",\n"
+      << " \"bytes\": " << bytes
+      << ", \"reallocations\": " << total.reallocations
+      << ", \"writes\": " << sink.writes
+      << ", \"bytesWritten\": " << sink.bytes << ",\n"
+      << " \"tracks\": [\n";
+  for(size_t i=0; i<reports.size(); i++){
+    const TrackReport & r = reports[i];
+    out << "  {\"events\": " << r.events
+        << ", \"bytes\": " << r.bytes
+        << ", \"buildSeconds\": " << r.stats.buildSeconds
+        << ", \"encodeSeconds\": " << r.stats.encodeSeconds
+        << ", \"reallocations\": " << r.stats.reallocations
+        << "}" << (i + 1 < reports.size() ? "," : "") << "\n";
+  }
+  out << "]}" << std::endl;
+}
+
+//build the song of a script to outputPath, or to the name the script gives
+//when it is empty. the output is only opened once the whole script parsed.
+void buildScript(ScriptReader & input, const std::string & outputPath, const BuildOptions & options, bool stats = false){
+  auto start = std::chrono::steady_clock::now();
+  ScriptParser script(input);
+  std::chrono::duration<double> parsed = std::chrono::steady_clock::now() - start;
+  MidiSink sink(outputPath.empty() ? script.filename : outputPath);
+  MidiBuilder midiBuilder(sink, options);
+  midiBuilder.write(script.song);
+  sink.finish();
+  if(options.verify)
+    printReports(midiBuilder.trackReports());
+  else if(options.repairNotes)
+    printRepairs(midiBuilder.trackReports());
+  if(stats){
+    std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+    printStats(std::cerr, parsed.count(), total.count(), midiBuilder.trackReports(), sink.stats());
+  }
+}
+
+
+//latencies in log-linear buckets, 8 for every power of two, so that a
+//percentile is within 1/8 of the exact value. record() can be called from
+//any thread.
+class LatencyHistogram{
+
+std::array<std::atomic<uint64_t>, 512> counts{};
+std::atomic<uint64_t> total{0};
+std::atomic<uint64_t> maxNs{0};
+
+  static size_t bucket(uint64_t ns){
+    if(ns < 8) return ns;
+    unsigned e = std::bit_width(ns) - 1;
+    return (e - 2) * 8 + ((ns >> (e - 3)) & 7);
+  }
+  static uint64_t lowest(size_t bucket){
+    if(bucket < 8) return bucket;
+    unsigned e = bucket / 8 + 2;
+    return (8 + bucket % 8) << (e - 3);
+  }
+
+public:
+  void record(std::chrono::steady_clock::duration latency){
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+    counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = maxNs.load(std::memory_order_relaxed);
+    while(ns > max && !maxNs.compare_exchange_weak(max, ns, std::memory_order_relaxed)){}
+  }
+  uint64_t count() const{
+    return total.load();
+  }
+  //latency below which a fraction q of the jobs were, in nanoseconds
+  uint64_t percentile(double q) const{
+    uint64_t rank = std::max<uint64_t>(1, std::ceil(q * total.load()));
+    uint64_t seen = 0;
+    for(size_t b=0; b<counts.size(); b++){
+      seen += counts[b].load(std::memory_order_relaxed);
+      if(seen >= rank) return std::min(lowest(b + 1) - 1, maxNs.load());
+    }
+    return maxNs.load();
+  }
+  void print(std::ostream & out, const char * what = "jobs", const char * measure = "latency") const{
+    auto us = [](uint64_t ns){ return ns / 1000.0; };
+    out << count() << " " << what << ", " << measure << " p50 " << us(percentile(0.5)) << " us, p90 "
+        << us(percentile(0.9)) << " us, p99 " << us(percentile(0.99)) << " us, p99.9 "
+        << us(percentile(0.999)) << " us, max " << us(maxNs.load()) << " us" << std::endl;
+  }
+};
+
+//workers running jobs from a bounded queue. submit() waits while the queue
+//is full, so a client sending jobs faster than they are built is slowed
+//down instead of growing the queue.
+class JobPool{
+
+std::deque<std::function<void()>> jobs{};
+size_t capacity{};
+bool stopping{false};
+std::mutex mutex{};
+std::condition_variable notEmpty{};
+std::condition_variable notFull{};
+std::vector<std::jthread> workers{};
+
+  void work(){
+    for(;;){
+      std::function<void()> job{};
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this]{ return stopping || !jobs.empty(); });
+        if(jobs.empty()) return;
+        job = std::move(jobs.front());
+        jobs.pop_front();
       }
-      else if(deltaTimeArr.at(1)){
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      notFull.notify_one();
+      job();
+    }
+  }
+
+public:
+  JobPool(unsigned threads, size_t capacity): capacity(capacity){
+    for(unsigned i=0; i<threads; i++)
+      workers.emplace_back([this]{ work(); });
+  }
+  //finish the jobs queued, then stop the workers
+  ~JobPool(){
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    notEmpty.notify_all();
+    workers.clear();
+  }
+  void submit(std::function<void()> job){
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      notFull.wait(lock, [this]{ return jobs.size() < capacity; });
+      jobs.push_back(std::move(job));
+    }
+    notEmpty.notify_one();
+  }
+};
+
+//jobs and replies are frames. a job is a 4 byte big endian length and a
+//script. a reply is a status byte (0 for a midi file, 1 for an error
+//message), a 4 byte big endian length and the file or the message.
+constexpr size_t maxFrameSize = 64 << 20;
+
+//read exactly size bytes, false if the input ends before the first one
+bool readFully(int fd, void * data, size_t size){
+  unsigned char * p = static_cast<unsigned char *>(data);
+  size_t done = 0;
+  while(done < size){
+    ssize_t n = ::read(fd, p + done, size - done);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) throw std::runtime_error(std::string("read failed: ") + std::strerror(errno));
+    if(n == 0){
+      if(done == 0) return false;
+      throw std::runtime_error("truncated frame");
+    }
+    done += n;
+  }
+  return true;
+}
+void writeFully(int fd, const void * data, size_t size){
+  const unsigned char * p = static_cast<const unsigned char *>(data);
+  while(size){
+    ssize_t n = ::write(fd, p, size);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) throw std::runtime_error(std::string("write failed: ") + std::strerror(errno));
+    p += n;
+    size -= n;
+  }
+}
+void putLength(unsigned char * out, size_t length){
+  for(unsigned i=0; i<4; i++)
+    out[i] = length >> (24 - 8 * i);
+}
+size_t getLength(const unsigned char * in){
+  return size_t(in[0]) << 24 | in[1] << 16 | in[2] << 8 | in[3];
+}
+//read a frame of size bytes after a length, false at the end of the input
+bool readFrame(int fd, std::string & frame){
+  unsigned char length[4];
+  if(!readFully(fd, length, 4)) return false;
+  size_t size = getLength(length);
+  if(size > maxFrameSize) throw std::runtime_error("frame larger than 64 MiB");
+  frame.resize(size);
+  if(size && !readFully(fd, frame.data(), size)) throw std::runtime_error("truncated frame");
+  return true;
+}
+std::string replyFrame(unsigned char status, const void * data, size_t size){
+  std::string reply(5 + size, '\0');
+  reply[0] = status;
+  putLength(reinterpret_cast<unsigned char *>(reply.data()) + 1, size);
+  std::memcpy(reply.data() + 5, data, size);
+  return reply;
+}
+
+//build the midi file of a job script. the name at its end is not used.
+std::string runJob(const std::string & script, const BuildOptions & options){
+  try{
+    ScriptReader input{std::string_view(script)};
+    ScriptParser parsed(input);
+    std::vector<unsigned char> midi = buildMidi(parsed.song, options);
+    return replyFrame(0, midi.data(), midi.size());
+  }
+  catch(const ScriptError & e){
+    std::string message = std::to_string(e.line) + ":" + std::to_string(e.column) + ": " + e.what();
+    return replyFrame(1, message.data(), message.size());
+  }
+  catch(const std::exception & e){
+    std::string message = e.what();
+    return replyFrame(1, message.data(), message.size());
+  }
+}
+
+//serve the jobs read from in, replying to out in the order of the jobs.
+//this thread reads the jobs and hands them to the pool, a writer thread
+//sends the replies as they are ready. at most 64 replies are pending, the
+//next job is only read once there is room.
+void serveJobs(int in, int out, JobPool & pool, LatencyHistogram & latencies, const BuildOptions & options){
+  struct Pending{
+    std::chrono::steady_clock::time_point received;
+    std::future<std::string> reply;
+  };
+  std::deque<Pending> pending{};
+  bool ended = false;
+  std::mutex mutex{};
+  std::condition_variable changed{};
+
+  std::jthread writer([&]{
+    bool open = true;
+    for(;;){
+      Pending next{};
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]{ return ended || !pending.empty(); });
+        if(pending.empty()) return;
+        next = std::move(pending.front());
       }
-      else if(deltaTimeArr.at(2)){
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      std::string reply = next.reply.get();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.pop_front();
       }
-      else{
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-    trackBuffer.push_back(0xb0 + channelNumber);
-    trackBuffer.push_back(controlNumber);
-    trackBuffer.push_back(startValue);
-
-    int diff = endValue - startValue;
-    unsigned time = 0;
-    for(int step=1;step<=steps;step++){
-      int value = startValue + step * diff / steps;
-      unsigned deltaTime = duration * step / steps - time;
-      time += deltaTime ;
-      std::array<unsigned char, 4> deltaTimeArr = uintTo7bits(deltaTime);
-      if(deltaTimeArr.at(0)){
-      trackBuffer.push_back(deltaTimeArr.at(0) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-      else if(deltaTimeArr.at(1)){
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-      else if(deltaTimeArr.at(2)){
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      changed.notify_all();
+      if(!open) continue;
+      try{
+        writeFully(out, reply.data(), reply.size());
+        latencies.record(std::chrono::steady_clock::now() - next.received);
       }
-      else{
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      catch(const std::exception &){
+        open = false;  //the client is gone, its remaining jobs are dropped
       }
+    }
+  });
 
-      trackBuffer.push_back(0xb0 + channelNumber);
-      trackBuffer.push_back(controlNumber);
-      trackBuffer.push_back(value);
+  try{
+    std::string script{};
+    while(readFrame(in, script)){
+      auto promise = std::make_shared<std::promise<std::string>>();
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]{ return pending.size() < 64; });
+        pending.push_back(Pending{std::chrono::steady_clock::now(), promise->get_future()});
+      }
+      changed.notify_all();
+      pool.submit([promise, script = std::move(script), &options]{
+        promise->set_value(runJob(script, options));
+      });
+      script = std::string();
     }
   }
-  void rampPitchWheelChange(std::vector<unsigned char> & trackBuffer, unsigned char channelNumber){
-    unsigned deltaTime{};
-    std::cout << "What is the delta time?" << std::endl
-              << "  > ";
-    std::cin >> deltaTime;
-    std::array<unsigned char, 4> deltaTimeArr = uintTo7bits(deltaTime);
+  catch(const std::exception & e){
+    std::cerr << "serve: " << e.what() << std::endl;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ended = true;
+  }
+  changed.notify_all();
+}
 
-//what is the start value?
-    int startValue{};
-    std::cout << "What is the start value?" << std::endl
-              << "  > ";
-    std::cin >> startValue;;
-//what is the end value?
-    int endValue{};
-    std::cout << "What is the end value?" << std::endl
-              << "  > ";
-    std::cin >> endValue;;
-//what is the duration of the ramp?
-    int duration{};
-    std::cout << "What is the ramp duration?" << std::endl
-              << "  > ";
-    std::cin >> duration;
-//how many steps/divisions in the ramp? (minimum 1)
-    int steps{};
-    std::cout << "How many steps in the ramp?" << std::endl
-              << "  > ";
-    std::cin >> steps;
+//the address of a unix domain socket at path
+sockaddr_un socketAddress(const std::string & path){
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(address.sun_path)) throw std::runtime_error("socket path too long: " + path);
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
 
-///
-    unsigned pitchWheelValue = startValue;
+//--serve path: serve the jobs of every client of a unix domain socket until
+//SIGINT or SIGTERM. --serve -: serve the jobs of stdin until it ends.
+//the latencies are printed when the server stops.
+int serve(const std::string & path, const BuildOptions & options){
+  BuildOptions jobOptions = options;
+  jobOptions.jobs = 1;  //jobs run in parallel instead of their tracks
+  LatencyHistogram latencies{};
+  std::signal(SIGPIPE, SIG_IGN);
 
-    unsigned char high = (pitchWheelValue & 0b11111110000000) >> 7;
-    unsigned char low = (pitchWheelValue &  0b00000001111111);
+  if(path == "-"){
+    {
+      JobPool pool(options.jobs, 2 * options.jobs);
+      serveJobs(STDIN_FILENO, STDOUT_FILENO, pool, latencies, jobOptions);
+    }
+    latencies.print(std::cerr);
+    return 0;
+  }
+
+  //the signals are taken by sigwait, from any of the threads
+  sigset_t stopSignals{};
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
 
+  int listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(listener < 0) throw std::runtime_error(std::string("cannot create socket: ") + std::strerror(errno));
+  sockaddr_un address = socketAddress(path);
+  ::unlink(path.c_str());
+  if(::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(listener, 128) != 0){
+    ::close(listener);
+    throw std::runtime_error("cannot listen on " + path + ": " + std::strerror(errno));
+  }
+  std::cerr << "serving on " << path << " with " << options.jobs << " workers" << std::endl;
 
+  std::mutex mutex{};
+  std::vector<int> clients{};
+  std::atomic<bool> stopping{false};
+  std::jthread stopper([&]{
+    int signal = 0;
+    sigwait(&stopSignals, &signal);
+    stopping = true;
+    ::shutdown(listener, SHUT_RDWR);
+    std::lock_guard<std::mutex> lock(mutex);
+    for(int fd: clients)
+      ::shutdown(fd, SHUT_RD);
+  });
 
-      if(deltaTimeArr.at(0)){
-      trackBuffer.push_back(deltaTimeArr.at(0) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+  {
+    JobPool pool(options.jobs, 2 * options.jobs);
+    //a thread per client, joined once the client is gone
+    struct Connection{
+      std::atomic<bool> done{false};
+      std::jthread thread{};
+    };
+    std::list<Connection> connections{};
+    while(!stopping){
+      int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if(fd < 0){
+        if(errno == EINTR || errno == ECONNABORTED) continue;
+        break;
       }
-      else if(deltaTimeArr.at(1)){
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      connections.remove_if([](const Connection & c){ return c.done.load(); });
+      std::lock_guard<std::mutex> lock(mutex);
+      clients.push_back(fd);
+      Connection & connection = connections.emplace_back();
+      connection.thread = std::jthread([&, fd]{
+        serveJobs(fd, fd, pool, latencies, jobOptions);
+        std::lock_guard<std::mutex> lock(mutex);
+        clients.erase(std::find(clients.begin(), clients.end(), fd));
+        ::close(fd);
+        connection.done = true;
+      });
+    }
+    if(!stopping) std::cerr << "serve: accept failed: " << std::strerror(errno) << std::endl;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for(int fd: clients)
+        ::shutdown(fd, SHUT_RD);
+    }
+    connections.clear();
+  }
+  ::close(listener);
+  ::unlink(path.c_str());
+  if(!stopping) ::kill(::getpid(), SIGTERM);  //let the stopper thread end
+  latencies.print(std::cerr);
+  return 0;
+}
+
+//--load path script: send the script as a job count times over connections
+//clients, each keeping up to window jobs in flight, and print the
+//throughput and the round trip latencies
+int loadTest(const std::string & path, const std::string & scriptPath, size_t count, unsigned clients, unsigned window){
+  std::string script = readScript(scriptPath);
+  std::string job(4, '\0');
+  putLength(reinterpret_cast<unsigned char *>(job.data()), script.size());
+  job += script;
+
+  LatencyHistogram latencies{};
+  std::atomic<size_t> errors{0};
+  sockaddr_un address = socketAddress(path);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::jthread> threads{};
+  for(unsigned c=0; c<clients; c++){
+    size_t quota = count / clients + (c < count % clients);
+    threads.emplace_back([&, quota]{
+      int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if(fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0){
+        std::cerr << "cannot connect to " << path << ": " << std::strerror(errno) << std::endl;
+        errors += quota;
+        if(fd >= 0) ::close(fd);
+        return;
       }
-      else if(deltaTimeArr.at(2)){
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      //the sender stays at most window jobs ahead of the replies
+      std::counting_semaphore<> inFlight(window);
+      std::mutex mutex{};
+      std::deque<std::chrono::steady_clock::time_point> sent{};
+      std::jthread sender([&]{
+        try{
+          for(size_t i=0; i<quota; i++){
+            inFlight.acquire();
+            {
+              std::lock_guard<std::mutex> lock(mutex);
+              sent.push_back(std::chrono::steady_clock::now());
+            }
+            writeFully(fd, job.data(), job.size());
+          }
+        }
+        catch(const std::exception & e){
+          std::cerr << "load: " << e.what() << std::endl;
+        }
+      });
+      size_t received = 0;
+      try{
+        std::string reply{};
+        for(; received<quota; received++){
+          unsigned char header[5];
+          if(!readFully(fd, header, 5)) throw std::runtime_error("server closed the connection");
+          reply.resize(getLength(header + 1));
+          if(!reply.empty() && !readFully(fd, reply.data(), reply.size())) throw std::runtime_error("truncated reply");
+          std::chrono::steady_clock::time_point sentAt{};
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            sentAt = sent.front();
+            sent.pop_front();
+          }
+          latencies.record(std::chrono::steady_clock::now() - sentAt);
+          if(header[0] != 0){
+            if(errors++ == 0) std::cerr << "job failed: " << reply << std::endl;
+          }
+          inFlight.release();
+        }
       }
-      else{
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-
-    trackBuffer.push_back(0xe0 + channelNumber);
-    trackBuffer.push_back(low);
-    trackBuffer.push_back(high);
-
-    int diff = endValue - startValue;
-    unsigned time = 0;
-    for(int step=1;step<=steps;step++){
-      int value = startValue + step * diff / steps;
-      unsigned char high = (value & 0b11111110000000) >> 7;
-      unsigned char low = (value &  0b00000001111111);
-      unsigned deltaTime = duration * step / steps - time;
-      time += deltaTime ;
-      std::array<unsigned char, 4> deltaTimeArr = uintTo7bits(deltaTime);
-      if(deltaTimeArr.at(0)){
-      trackBuffer.push_back(deltaTimeArr.at(0) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-      else if(deltaTimeArr.at(1)){
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-      else if(deltaTimeArr.at(2)){
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      catch(const std::exception & e){
+        std::cerr << "load: " << e.what() << std::endl;
+        errors += quota - received;
+        ::shutdown(fd, SHUT_RDWR);
+        inFlight.release(window);
       }
-      else{
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-
-      trackBuffer.push_back(0xe0 + channelNumber);
-      trackBuffer.push_back(low);
-      trackBuffer.push_back(high);
-    }
-  }
-  void controlChange(std::vector<unsigned char> & trackBuffer, unsigned char channelNumber){
-    unsigned deltaTime{};
-    std::cout << "What is the delta time?" << std::endl
-              << "  > ";
-    std::cin >> deltaTime;
-    std::array<unsigned char, 4> deltaTimeArr = uintTo7bits(deltaTime);
-
-    unsigned char controlNumber{}; //0-127
-    std::cout << "What is the control number?" << std::endl << "  > ";
-    unsigned cn{};
-    std::cin >> cn;
-    controlNumber = cn & 0x000000ff;
-    unsigned char controlValue{}; //0-127
-    std::cout << "What is the control value?" << std::endl << "  > ";
-    unsigned cv{};
-    std::cin >> cv;
-    controlValue = cv & 0x000000ff;
-      if(deltaTimeArr.at(0)){
-      trackBuffer.push_back(deltaTimeArr.at(0) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-      else if(deltaTimeArr.at(1)){
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-      else if(deltaTimeArr.at(2)){
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      sender.join();
+      ::close(fd);
+    });
+  }
+  threads.clear();
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << latencies.count() << " replies in " << elapsed.count() << " s, "
+            << latencies.count() / elapsed.count() << " jobs/s, " << errors << " errors" << std::endl;
+  latencies.print(std::cout);
+  return errors ? 1 : 0;
+}
+
+
+//workers with a deque of tasks each. a worker runs the newest task of its
+//own deque first (the tracks of the song it just parsed), and when it has
+//none takes the oldest task of another worker. tasks submitted by a task
+//go to the deque of its worker, the others are dealt round robin.
+class StealingPool{
+
+struct Queue{
+  std::mutex mutex{};
+  std::deque<std::function<void()>> tasks{};
+};
+std::vector<Queue> queues;
+std::atomic<size_t> queued{0};      //tasks in the deques
+std::atomic<size_t> unfinished{0};  //tasks submitted and not done
+std::atomic<size_t> nextQueue{0};
+bool stopping{false};
+std::mutex mutex{};
+std::condition_variable wake{};     //a task was queued, or the pool stops
+std::condition_variable idle{};     //every task submitted is done
+std::vector<std::jthread> workers{};
+inline static thread_local StealingPool * currentPool{};
+inline static thread_local size_t currentWorker{};
+
+  bool take(size_t self, std::function<void()> & task){
+    for(size_t k=0; k<queues.size(); k++){
+      Queue & queue = queues[(self + k) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if(queue.tasks.empty()) continue;
+      if(k == 0){
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
       }
       else{
-      trackBuffer.push_back(deltaTimeArr.at(3));
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      }
+      queued--;
+      return true;
+    }
+    return false;
+  }
+  void work(size_t self){
+    currentPool = this;
+    currentWorker = self;
+    for(;;){
+      std::function<void()> task{};
+      if(!take(self, task)){
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this]{ return stopping || queued > 0; });
+        if(queued == 0) return;
+        continue;
+      }
+      task();
+      if(--unfinished == 0){
+        std::lock_guard<std::mutex> lock(mutex);
+        idle.notify_all();
       }
-    trackBuffer.push_back(0xb0 + channelNumber);
-    trackBuffer.push_back(controlNumber);
-    trackBuffer.push_back(controlValue);
+    }
   }
-  void pitchWheelChange(std::vector<unsigned char> & trackBuffer, unsigned char channelNumber){
-    unsigned pitchWheelValue{}; //0-0x4000
-    unsigned deltaTime{};
-    std::cout << "What is the delta time?" << std::endl
-              << "  > ";
-    std::cin >> deltaTime;
 
-    std::array<unsigned char, 4> deltaTimeArr = uintTo7bits(deltaTime);
+public:
+  explicit StealingPool(unsigned threads): queues(std::max(1u, threads)){
+    for(size_t i=0; i<queues.size(); i++)
+      workers.emplace_back([this, i]{ work(i); });
+  }
+  //finish the tasks queued, then stop the workers
+  ~StealingPool(){
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    workers.clear();
+  }
+  void submit(std::function<void()> task){
+    unfinished++;
+    size_t i = currentPool == this ? currentWorker : nextQueue++ % queues.size();
+    {
+      std::lock_guard<std::mutex> lock(queues[i].mutex);
+      queues[i].tasks.push_back(std::move(task));
+    }
+    queued++;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+    }
+    wake.notify_one();
+  }
+  //until every task submitted, and the ones they submitted, are done
+  void wait(){
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]{ return unfinished == 0; });
+  }
+};
 
-    std::cout << "What is the Pitch Wheel value? (0-0x3FFF)" << std::endl << "  > ";
-    std::cin >> pitchWheelValue;
-    unsigned char high = (pitchWheelValue & 0b11111110000000) >> 7;
-    unsigned char low = (pitchWheelValue &  0b00000001111111);
+//writes files on a thread of its own: the files queued are taken as a
+//batch, and the parts of a file (header, track chunks) go out in one
+//writev, without being copied together. put() waits while more than
+//maxQueued bytes are waiting, so the builders can't outrun the disk
+//without bound.
+class OutputWriter{
+public:
+  struct File{
+    size_t job{};
+    std::string path{};
+    std::vector<std::vector<unsigned char>> parts{};
+  };
 
-      if(deltaTimeArr.at(0)){
-      trackBuffer.push_back(deltaTimeArr.at(0) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+private:
+std::deque<File> files{};
+size_t queuedBytes{};
+size_t maxQueued{};
+bool stopping{false};
+std::mutex mutex{};
+std::condition_variable notEmpty{};
+std::condition_variable notFull{};
+std::function<void(size_t job, const std::string & message)> failed{};
+std::atomic<size_t> filesWritten{0};
+std::atomic<size_t> bytesWritten{0};
+std::jthread thread{};
+
+  static size_t size(const File & file){
+    size_t bytes = 0;
+    for(const auto & part: file.parts)
+      bytes += part.size();
+    return bytes;
+  }
+  void write(const File & file){
+    int fd = ::open(file.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(fd < 0){
+      failed(file.job, "cannot open " + file.path + ": " + std::strerror(errno));
+      return;
+    }
+    std::vector<iovec> parts{};
+    for(const auto & part: file.parts)
+      if(!part.empty()) parts.push_back(iovec{const_cast<unsigned char *>(part.data()), part.size()});
+    size_t next = 0;
+    int error = 0;
+    while(next < parts.size() && !error){
+      ssize_t n = ::writev(fd, parts.data() + next, std::min<size_t>(parts.size() - next, IOV_MAX));
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0){
+        error = n < 0 ? errno : EIO;
+        break;
       }
-      else if(deltaTimeArr.at(1)){
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      //past the parts written whole, into the one written in part
+      for(size_t done = n; done;){
+        size_t step = std::min(done, parts[next].iov_len);
+        parts[next].iov_base = static_cast<unsigned char *>(parts[next].iov_base) + step;
+        parts[next].iov_len -= step;
+        done -= step;
+        if(!parts[next].iov_len) next++;
       }
-      else if(deltaTimeArr.at(2)){
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+    }
+    if(::close(fd) != 0 && !error) error = errno;
+    if(error){
+      failed(file.job, "cannot write " + file.path + ": " + std::strerror(error));
+      return;
+    }
+    filesWritten++;
+    bytesWritten += size(file);
+  }
+  void run(){
+    for(;;){
+      std::deque<File> batch{};
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this]{ return stopping || !files.empty(); });
+        if(files.empty()) return;
+        batch.swap(files);
       }
-      else{
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      size_t bytes = 0;
+      for(const auto & file: batch){
+        write(file);
+        bytes += size(file);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        queuedBytes -= bytes;
       }
+      notFull.notify_all();
+    }
+  }
 
-    trackBuffer.push_back(0xe0 + channelNumber);
-    trackBuffer.push_back(low);
-    trackBuffer.push_back(high);
+public:
+  OutputWriter(size_t maxQueued, std::function<void(size_t job, const std::string & message)> failed)
+    : maxQueued(maxQueued), failed(std::move(failed)){
+    thread = std::jthread([this]{ run(); });
+  }
+  ~OutputWriter(){
+    finish();
+  }
+  //write the files queued, then stop
+  void finish(){
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    notEmpty.notify_one();
+    if(thread.joinable()) thread.join();
+  }
+  void put(File file){
+    size_t bytes = size(file);
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      notFull.wait(lock, [&]{ return queuedBytes == 0 || queuedBytes + bytes <= maxQueued; });
+      queuedBytes += bytes;
+      files.push_back(std::move(file));
+    }
+    notEmpty.notify_one();
+  }
+  size_t written() const{
+    return filesWritten;
   }
-  void buildNotes(std::vector<unsigned char> & trackBuffer, unsigned char channelNumber, unsigned numberOfNotes){
-    unsigned deltaTime{};
-    unsigned velocity{};
-    unsigned duration{};
+  size_t writtenBytes() const{
+    return bytesWritten;
+  }
+};
 
-    std::cout << "What is the delta time?" << std::endl
-              << "  > ";
-    std::cin >> deltaTime;
-    std::cout << "What is the duration?" << std::endl
-              << "  > ";
-    std::cin >> duration;
-    std::cout << "What is the velocity?(0-127)" << std::endl
-              << "  > ";
-    std::cin >> velocity;
+//--manifest file: build the songs of a manifest. a line is the output path,
+//then the scripts that make the song, put together in order (like cat
+//header track1 track2 footer). songs are built on a StealingPool, the ones
+//of at least manifestSplitEvents events as a task per track, and written
+//by an OutputWriter. failing songs are reported at the end, the others are
+//written all the same.
+constexpr size_t manifestSplitEvents = 1 << 16;
 
-    std::vector<unsigned char> noteNumbers{};
+int runManifest(const std::string & path, const BuildOptions & options){
+  struct Job{
+    size_t line{};
+    std::string output{};
+    std::vector<std::string> scripts{};
+  };
+  std::vector<Job> jobs{};
+  {
+    std::istringstream manifest(readScript(path));
+    std::string text{};
+    for(size_t line = 1; std::getline(manifest, text); line++){
+      std::istringstream fields(text.substr(0, text.find('#')));
+      Job job{line};
+      if(!(fields >> job.output)) continue;
+      for(std::string script; fields >> script;)
+        job.scripts.push_back(script);
+      jobs.push_back(std::move(job));
+    }
+  }
+  if(!options.cacheDirectory.empty() && ::mkdir(options.cacheDirectory.c_str(), 0777) != 0 && errno != EEXIST)
+    throw std::runtime_error("cannot create " + options.cacheDirectory + ": " + std::strerror(errno));
 
-    for(unsigned i=0; i<numberOfNotes; i++)
-    {
-      unsigned noteNumber{};
-      std::cout << i
-                << " - What is the note number?(0-127)" << std::endl
-                << "  > ";
-      std::cin >> noteNumber;
-      noteNumbers.push_back(noteNumber);
-    }
-
-    writeSimultaneousNotes(
-      trackBuffer,
-      channelNumber,
-      deltaTime,
-      duration,
-      velocity,
-      noteNumbers);
-
-  }
-  void writeSimultaneousNotes(
-    std::vector<unsigned char> & trackBuffer,
-    unsigned char channelNumber,
-    unsigned deltaTime,
-    unsigned duration,
-    unsigned velocity,
-    std::vector<unsigned char> noteNumbers)
+  std::mutex failuresMutex{};
+  std::vector<std::pair<size_t, std::string>> failures{};
+  auto fail = [&](size_t line, const std::string & message){
+    std::lock_guard<std::mutex> lock(failuresMutex);
+    failures.emplace_back(line, message);
+  };
+  //the pool is the parallelism, every song is built on one thread
+  BuildOptions songOptions = options;
+  songOptions.jobs = 1;
+  std::atomic<size_t> events{0};
+  size_t filesWritten = 0;
+  size_t bytesWritten = 0;
+  auto start = std::chrono::steady_clock::now();
   {
-    std::array<unsigned char, 4> deltaTimeArr = uintTo7bits(deltaTime);
-    std::array<unsigned char, 4> durationArr = uintTo7bits(duration);
-    for(auto noteNumber: noteNumbers){
-      if(deltaTimeArr.at(0)){
-      trackBuffer.push_back(deltaTimeArr.at(0) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-      else if(deltaTimeArr.at(1)){
-      trackBuffer.push_back(deltaTimeArr.at(1) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
-      }
-      else if(deltaTimeArr.at(2)){
-      trackBuffer.push_back(deltaTimeArr.at(2) + 0b10000000);
-      trackBuffer.push_back(deltaTimeArr.at(3));
+    OutputWriter writer(256 << 20, fail);
+    StealingPool pool(options.jobs);
+    //the tracks of a song split into tasks, written when the last one is done
+    struct Split{
+      Song song{};
+      BuildOptions options{};
+      std::vector<std::vector<unsigned char>> parts{};
+      std::atomic<size_t> left{};
+      std::mutex mutex{};
+      std::string error{};
+    };
+    auto build = [&](const Job & job){
+      std::string script{};
+      if(job.scripts.empty()) throw std::runtime_error("no scripts");
+      for(const auto & scriptPath: job.scripts){
+        script += readScript(scriptPath);
+        script += '\n';
       }
-      else{
-      trackBuffer.push_back(deltaTimeArr.at(3));
+      ScriptReader input(std::move(script));
+      ScriptParser parsed(input);
+      size_t count = 0;
+      for(const auto & track: parsed.song.tracks)
+        count += MidiBuilder::eventCount(track);
+      events += count;
+      const Song & song = parsed.song;
+      bool merged = options.flatten || (song.fileType == 0 && song.tracks.size() > 1);
+      if(merged || song.tracks.size() < 2 || count < manifestSplitEvents){
+        OutputWriter::File file{job.line, job.output};
+        file.parts.push_back(buildMidi(song, songOptions));
+        writer.put(std::move(file));
+        return;
+      }
+      auto split = std::make_shared<Split>();
+      split->song = std::move(parsed.song);
+      unsigned short divisionTime = split->song.divisionTime;
+      split->options = MidiBuilder::optionsFor(songOptions, divisionTime);
+      const auto header = midiHeader(split->song.fileType, split->song.tracks.size(), divisionTime);
+      split->parts.resize(split->song.tracks.size() + 1);
+      split->parts[0].assign(header.begin(), header.end());
+      split->left = split->song.tracks.size();
+      for(size_t i=0; i<split->song.tracks.size(); i++){
+        pool.submit([&writer, &fail, split, i, line = job.line, output = job.output]{
+          try{
+            MidiBuilder::cachedTrack(split->song.tracks[i], i, split->parts[i + 1], nullptr, split->options,
+                                     split->song.patterns);
+          }
+          catch(const std::exception & e){
+            std::lock_guard<std::mutex> lock(split->mutex);
+            if(split->error.empty()) split->error = "track " + std::to_string(i) + ": " + e.what();
+          }
+          if(--split->left) return;
+          if(!split->error.empty()) return fail(line, output + ": " + split->error);
+          writer.put(OutputWriter::File{line, output, std::move(split->parts)});
+        });
+      }
+    };
+    for(auto & job: jobs){
+      pool.submit([&, job = std::move(job)]{
+        try{
+          build(job);
+        }
+        catch(const ScriptError & e){
+          fail(job.line, job.output + ": script " + std::to_string(e.line) + ":" + std::to_string(e.column) + ": " + e.what());
+        }
+        catch(const std::exception & e){
+          fail(job.line, job.output + ": " + e.what());
+        }
+      });
+    }
+    pool.wait();
+    writer.finish();
+    filesWritten = writer.written();
+    bytesWritten = writer.writtenBytes();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  std::sort(failures.begin(), failures.end());
+  for(const auto & [line, message]: failures)
+    std::cerr << path << ":" << line << ": " << message << std::endl;
+  std::cerr << filesWritten << " songs written, " << failures.size() << " failed, in " << elapsed.count() << " s: "
+            << filesWritten / elapsed.count() << " songs/s, " << events / elapsed.count() / 1e6 << " M events/s, "
+            << bytesWritten / elapsed.count() / 1e6 << " MB/s" << std::endl;
+  return failures.empty() ? 0 : 1;
+}
+
+
+//a ring of capacity (a power of two) slots between one producer and one
+//consumer, without locks: each side only writes its own index, and reads
+//the other's. a side with nothing to do sleeps on the other's index.
+template<typename T, size_t capacity>
+class SpscQueue{
+static_assert(std::has_single_bit(capacity), "the capacity is a power of two");
+
+std::array<T, capacity> slots{};
+alignas(64) std::atomic<size_t> head{0};  //next slot to pop, moved by the consumer
+alignas(64) std::atomic<size_t> tail{0};  //next slot to push, moved by the producer
+
+public:
+  bool push(const T & value){
+    size_t t = tail.load(std::memory_order_relaxed);
+    if(t - head.load(std::memory_order_acquire) == capacity) return false;
+    slots[t % capacity] = value;
+    tail.store(t + 1, std::memory_order_release);
+    tail.notify_one();
+    return true;
+  }
+  bool pop(T & value){
+    size_t h = head.load(std::memory_order_relaxed);
+    if(h == tail.load(std::memory_order_acquire)) return false;
+    value = slots[h % capacity];
+    head.store(h + 1, std::memory_order_release);
+    head.notify_one();
+    return true;
+  }
+  //producer: until a slot is free
+  void waitForRoom(){
+    size_t h = head.load(std::memory_order_acquire);
+    if(tail.load(std::memory_order_relaxed) - h == capacity) head.wait(h, std::memory_order_acquire);
+  }
+  //consumer: until a value is pushed
+  void waitForValue(){
+    size_t t = tail.load(std::memory_order_acquire);
+    if(head.load(std::memory_order_relaxed) == t) tail.wait(t, std::memory_order_acquire);
+  }
+};
+
+//an event on its way to the timing thread, size 0 ends the song
+struct LiveEvent{
+  uint64_t tick{};
+  unsigned char size{};
+  unsigned char bytes[3]{};
+};
+
+volatile std::sig_atomic_t liveStopped = 0;
+
+//--live output: play the song of a script in real time, as raw midi bytes
+//written to output (a named pipe, a raw midi device, or "-" for stdout).
+//an encoder thread builds the events of the tracks and merges them by tick
+//into a SpscQueue, the timing thread sleeps on the monotonic clock until
+//each tick is due and writes the events of that tick at once. how late the
+//writes were is printed at the end. interrupted (SIGINT, SIGTERM), every
+//channel gets an all notes off.
+int live(const Song & song, const std::string & path, double tempo, const BuildOptions & options){
+  unsigned short divisionTime = song.divisionTime;
+  const BuildOptions liveOptions = MidiBuilder::optionsFor(options, divisionTime);
+  if(divisionTime == 0 || divisionTime & 0x8000)
+    throw std::runtime_error("live playback needs a division in ticks per quarter note");
+  int fd = path == "-" ? STDOUT_FILENO : ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if(fd < 0) throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+  std::signal(SIGPIPE, SIG_IGN);
+  std::signal(SIGINT, [](int){ liveStopped = 1; });
+  std::signal(SIGTERM, [](int){ liveStopped = 1; });
+  //false once the reader is gone, or on an error thrown at the end
+  std::string writeError{};
+  auto send = [&](const std::vector<unsigned char> & bytes){
+    size_t done = 0;
+    while(done < bytes.size()){
+      ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+      if(n < 0 && errno == EINTR) continue;
+      if(n < 0){
+        if(errno != EPIPE) writeError = "cannot write " + path + ": " + std::strerror(errno);
+        return false;
       }
-      trackBuffer.push_back(0x90 + channelNumber);
-      trackBuffer.push_back((char) noteNumber);
-      trackBuffer.push_back((char) velocity);
+      done += n;
     }
+    return true;
+  };
 
-    bool first = true;
-    for(auto noteNumber: noteNumbers){
-      if(!first) durationArr = std::array<unsigned char,4>{0x00,0x00,0x00,0x00};
-      if(durationArr.at(0)){
-      trackBuffer.push_back(durationArr.at(0) + 0b10000000);
-      trackBuffer.push_back(durationArr.at(1) + 0b10000000);
-      trackBuffer.push_back(durationArr.at(2) + 0b10000000);
-      trackBuffer.push_back(durationArr.at(3));
+  auto queue = std::make_unique<SpscQueue<LiveEvent, 4096>>();
+  std::atomic<bool> stopping{false};
+  std::exception_ptr encoderError{};
+  //the encoder starts with SIGINT and SIGTERM blocked, so that they only
+  //wake the timing thread
+  sigset_t stopSignals{}, previousMask{};
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, &previousMask);
+  std::jthread encoder([&]{
+    auto push = [&](const LiveEvent & event){
+      for(;;){
+        if(stopping) return false;
+        if(queue->push(event)) return true;
+        queue->waitForRoom();
       }
-      else if(durationArr.at(1)){
-      trackBuffer.push_back(durationArr.at(1) + 0b10000000);
-      trackBuffer.push_back(durationArr.at(2) + 0b10000000);
-      trackBuffer.push_back(durationArr.at(3));
+    };
+    try{
+      //the next event of every track playing, earliest first, by track on
+      //the same tick. tracks are built as they are played.
+      struct Playing{
+        EventBatches batches;
+        size_t at{};
+        uint64_t offset{};
+        uint64_t endTick{};
+      };
+      std::vector<Playing> tracks{};
+      using Next = std::pair<uint64_t, size_t>;
+      std::priority_queue<Next, std::vector<Next>, std::greater<Next>> heap{};
+      //false once track i is done
+      auto pull = [&](size_t i){
+        Playing & track = tracks[i];
+        while(track.at == track.batches.batch().size()){
+          if(!track.batches.next()) return false;
+          track.at = 0;
+          track.endTick = std::max<uint64_t>(track.endTick, track.batches.batch().endTick);
+        }
+        heap.push({track.offset + track.batches.batch().ticks[track.at], i});
+        return true;
+      };
+      //the tracks of a type 2 song play one after the other, the others together
+      size_t together = song.fileType == 2 ? 1 : song.tracks.size();
+      uint64_t offset = 0;
+      for(size_t first=0; first<song.tracks.size(); first+=together){
+        tracks.clear();
+        for(size_t i=first; i<first + together; i++){
+          tracks.push_back(Playing{MidiBuilder::buildBatches(song.tracks[i], i, liveOptions, song.patterns, false,
+                                                             MidiBuilder::streamBatchEvents), 0, offset});
+          if(tracks.back().batches.next()) pull(tracks.size() - 1);
+        }
+        while(!heap.empty()){
+          auto [tick, i] = heap.top();
+          heap.pop();
+          Playing & track = tracks[i];
+          const EventList & events = track.batches.batch();
+          size_t at = track.at++;
+          track.endTick = std::max<uint64_t>(track.endTick, events.ticks[at]);
+          //meta events stay in files, 0xFF on the wire is a reset
+          unsigned char status = events.statuses[at];
+          if(status < 0xf0){
+            LiveEvent event{tick, static_cast<unsigned char>(hasData2(status) ? 3 : 2),
+                            {status, events.data1[at], events.data2[at]}};
+            if(!push(event)) return;
+          }
+          pull(i);
+        }
+        for(const Playing & track: tracks)
+          offset = std::max(offset, track.offset + track.endTick);
       }
-      else if(durationArr.at(2)){
-      trackBuffer.push_back(durationArr.at(2) + 0b10000000);
-      trackBuffer.push_back(durationArr.at(3));
+    }
+    catch(...){
+      encoderError = std::current_exception();
+    }
+    push(LiveEvent{});
+  });
+  pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+
+  //ticks to nanoseconds from the start
+  const double tickNs = 60e9 / (tempo * divisionTime);
+  LatencyHistogram lateness{};
+  std::vector<unsigned char> bytes{};
+  LiveEvent event{};
+  bool have = false;  //event is popped and not written yet
+  std::chrono::steady_clock::time_point start{};
+  bool started = false;
+  bool open = true;
+  while(!liveStopped && open){
+    if(!have && !queue->pop(event)){
+      queue->waitForValue();
+      continue;
+    }
+    have = false;
+    if(event.size == 0) break;
+    if(!started){
+      //the clock starts with the first event, so that building the tracks doesn't count
+      start = std::chrono::steady_clock::now() - std::chrono::nanoseconds(static_cast<int64_t>(event.tick * tickNs));
+      started = true;
+    }
+    auto due = start + std::chrono::nanoseconds(static_cast<int64_t>(event.tick * tickNs));
+    int64_t dueNs = std::chrono::duration_cast<std::chrono::nanoseconds>(due.time_since_epoch()).count();
+    timespec wake{static_cast<time_t>(dueNs / 1000000000), static_cast<long>(dueNs % 1000000000)};
+    while(!liveStopped && ::clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, nullptr) == EINTR){}
+    if(liveStopped) break;
+    //the events of the same tick already queued go in the same write
+    uint64_t tick = event.tick;
+    bytes.assign(event.bytes, event.bytes + event.size);
+    while(queue->pop(event)){
+      if(event.size == 0 || event.tick != tick){
+        have = true;
+        break;
       }
-      else{
-      trackBuffer.push_back(durationArr.at(3));
-      }
-      trackBuffer.push_back(0x90 + channelNumber);
-      trackBuffer.push_back((char) noteNumber);
-      trackBuffer.push_back(0x00);
-      first = false;
-    }
-  }
-  void arpeggio(std::vector<unsigned char> & trackBuffer, unsigned char channelNumber){
-    unsigned numberOfNoteNumbers;
-    unsigned numberOfNotesToPlay;
-    unsigned arpMode; //order vs random
-    unsigned deltaTime{};
-    unsigned velocity{};
-    unsigned duration{};
-
-    std::cout << "What is the delta time?" << std::endl
-              << "  > ";
-    std::cin >> deltaTime;
-    std::cout << "What is the duration?" << std::endl
-              << "  > ";
-    std::cin >> duration;
-    std::cout << "What is the velocity?(0-127)" << std::endl
-              << "  > ";
-    std::cin >> velocity;
-    std::cout << "How many notes to play?" << std::endl
-              << "  > ";
-    std::cin >> numberOfNotesToPlay;
-    std::cout << "How many note numbers?" << std::endl
-              << "  > ";
-    std::cin >> numberOfNoteNumbers;
-    std::cout << "How to arpeggiate the notes?" << std::endl
-              << "  0 - In order" << std::endl
-              << "  1 - In random order" << std::endl
-              << "  > ";
-    std::cin >> arpMode;
-
-    std::vector<unsigned char> noteNumbers{};
-
-    for(unsigned i=0; i<numberOfNoteNumbers; i++)
-    {
-      unsigned noteNumber{};
-      std::cout << i
-                << " - What is the note number?(0-127)" << std::endl
-                << "  > ";
-      std::cin >> noteNumber;
-      noteNumbers.push_back(noteNumber);
+      bytes.insert(bytes.end(), event.bytes, event.bytes + event.size);
     }
+    lateness.record(std::max(std::chrono::steady_clock::duration{}, std::chrono::steady_clock::now() - due));
+    open = send(bytes);
+  }
 
+  stopping = true;
+  if(liveStopped && open){
+    bytes.clear();
+    for(unsigned char channel=0; channel<16; channel++)
+      bytes.insert(bytes.end(), {static_cast<unsigned char>(0xb0 + channel), 123, 0});
+    send(bytes);
+  }
+  //so that a waiting encoder sees stopping
+  while(queue->pop(event)){}
+  encoder.join();
+  if(fd != STDOUT_FILENO) ::close(fd);
+  lateness.print(std::cerr, "writes", "lateness");
+  if(encoderError) std::rethrow_exception(encoderError);
+  if(!writeError.empty()) throw std::runtime_error(writeError);
+  return liveStopped ? 130 : 0;
+}
 
-    std::vector<unsigned char> sequence{};
 
-    if(arpMode == 0){
-      auto iter = noteNumbers.begin();
-      for(unsigned i=0; i<numberOfNotesToPlay; i++){
-        sequence.push_back(*iter);
-        iter++;
-        if(iter == noteNumbers.end()) iter = noteNumbers.begin();
-      }
+//a line of a disassembled track, waiting until its note ends
+struct ScriptLine{
+  unsigned tick{};
+  unsigned char status{};
+  unsigned char data1{};
+  unsigned char data2{};
+  unsigned duration{};
+  bool open{false};        //a note still waiting for its note-off
+  std::string comment{};   //for events a script can't express
+};
+
+//print the events of a track as script events. notes become held notes (5)
+//once their note-off is read, lines are printed in the order of the events.
+void disassembleTrack(EventReader reader, std::ostream & out){
+  std::deque<ScriptLine> lines{};
+  size_t firstLine = 0;                                  //number of lines.front()
+  std::vector<std::vector<size_t>> sounding(16 * 128);   //lines of the notes that are on
+  unsigned cursor = 0;
+  unsigned channel = 0;
+
+  auto print = [&](const ScriptLine & line){
+    if(!line.comment.empty()){
+      out << "# " << line.tick << ": " << line.comment << "\n";
+      return;
     }
-    else if(arpMode == 1){
-      for(unsigned i=0; i<numberOfNotesToPlay; i++){
-        sequence.push_back(noteNumbers.at(rand()%noteNumbers.size()));
-      }
+    unsigned lineChannel = line.status & 0x0f;
+    if(lineChannel != channel){
+      out << "12 " << lineChannel << "\n";
+      channel = lineChannel;
+    }
+    unsigned delta = line.tick - cursor;
+    cursor = line.tick;
+    switch(line.status & 0xf0){
+      case 0x90:
+        out << "5 " << delta << " " << line.duration << " " << unsigned(line.data2)
+            << " 1 " << unsigned(line.data1) << "\n";
+        break;
+      case 0xb0:
+        out << "11 " << delta << " " << unsigned(line.data1) << " " << unsigned(line.data2) << "\n";
+        break;
+      case 0xc0:
+        if(delta) out << "6 " << delta << "\n";
+        out << "10 " << unsigned(line.data1) << "\n";
+        break;
+      case 0xe0:
+        out << "13 " << delta << " " << (line.data1 | line.data2 << 7) << "\n";
+        break;
+    }
+  };
+  auto flush = [&](bool all){
+    while(!lines.empty() && (all || !lines.front().open)){
+      print(lines.front());
+      lines.pop_front();
+      firstLine++;
+    }
+  };
+  auto comment = [](const MidiEvent & event){
+    static const char * names[] = {"note off", "note on", "key pressure", "control change",
+                                   "program change", "channel pressure", "pitch wheel"};
+    std::ostringstream text{};
+    text << std::hex;
+    if(event.status == 0xff) text << "meta 0x" << unsigned(event.type) << ":";
+    else if(event.status >= 0xf0) text << "system exclusive 0x" << unsigned(event.status) << ":";
+    else text << names[(event.status >> 4) - 8] << " channel " << std::dec << (event.status & 0x0f) << std::hex << ":";
+    for(unsigned i=0; i<event.size && i<32; i++)
+      text << " " << unsigned(event.data[i]);
+    if(event.size > 32) text << " ...";
+    return text.str();
+  };
+
+  MidiEvent event{};
+  while(reader.next(event)){
+    unsigned char kind = event.status & 0xf0;
+    ScriptLine line{};
+    line.tick = event.tick;
+    line.status = event.status;
+    if(event.status < 0xf0){
+      line.data1 = event.data[0];
+      if(event.size == 2) line.data2 = event.data[1];
+    }
+    auto & notes = sounding[(event.status & 0x0f) * 128 + (line.data1 & 0x7f)];
+    if(kind == 0x90 && line.data2){
+      line.open = true;
+      notes.push_back(firstLine + lines.size());
+      lines.push_back(line);
+    }
+    else if(kind == 0x80 || kind == 0x90){
+      if(notes.empty()) continue;
+      ScriptLine & on = lines[notes.front() - firstLine];
+      on.duration = event.tick - on.tick;
+      on.open = false;
+      notes.erase(notes.begin());
+    }
+    else if(kind == 0xb0 || kind == 0xc0 || kind == 0xe0){
+      lines.push_back(line);
+    }
+    else{
+      line.comment = comment(event);
+      lines.push_back(line);
+    }
+    flush(false);
+  }
+
+  //notes still on at the end of track last until then
+  for(auto & line: lines){
+    if(line.open) line.duration = reader.time() - line.tick;
+    line.open = false;
+  }
+  flush(true);
+  if(reader.time() > cursor)
+    out << "6 " << reader.time() - cursor << "\n";
+}
+
+//print a midi file as a batch script that builds it again
+void disassemble(const MidiFileReader & file, const std::string & filename, std::ostream & out){
+  out << "# type, tracks, ticks per quarter note\n"
+      << file.fileType << "\n"
+      << file.trackChunks.size() << "\n"
+      << file.divisionTime << "\n";
+  for(size_t i=0; i<file.trackChunks.size(); i++){
+    out << "\n# track " << i << "\n";
+    disassembleTrack(file.events(i), out);
+    out << "0\n";
+  }
+  out << "\n" << filename << "\n";
+}
+
+
+//encode throughput of writeVarLen for short and long delta times
+void benchVarLen(){
+  constexpr unsigned valueCount = 1 << 20;
+  constexpr unsigned rounds = 32;
+  struct Case{
+    const char * name;
+    unsigned low;
+    unsigned high;
+  };
+  for(const Case & c: {Case{"short delta times (1 byte)", 0, 0x7f},
+                       Case{"medium delta times (2 bytes)", 0x80, 0x3fff},
+                       Case{"long delta times (4 bytes)", 0x200000, maxVarLen}}){
+    std::vector<unsigned> values(valueCount);
+    unsigned seed = 12345;
+    for(auto & value: values){
+      seed = seed * 1664525 + 1013904223;
+      value = c.low + seed % (c.high - c.low + 1);
+    }
+    double events = double(valueCount) * rounds;
+    auto report = [&](const char * writer, auto start, unsigned long long bytes){
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      std::cout << c.name << ", " << writer << ": "
+                << elapsed.count() * 1e9 / events << " ns/event, "
+                << events / elapsed.count() / 1e6 << " Mevents/s, "
+                << bytes / elapsed.count() / 1e6 << " MB/s" << std::endl;
+    };
+
+    std::vector<unsigned char> buffer{};
+    buffer.reserve(valueCount * 4 + 4);
+    unsigned long long bytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned round=0; round<rounds; round++){
+      buffer.clear();
+      for(auto value: values)
+        writeVarLen(buffer, value);
+      bytes += buffer.size();
     }
-    for(auto noteNumber: sequence){
-      writeSimultaneousNotes(
-        trackBuffer,
-        channelNumber,
-        deltaTime,
-        duration,
-        velocity,
-        {noteNumber});
+    report("vector", start, bytes);
+
+    buffer.assign(valueCount * 4 + 4, 0);
+    bytes = 0;
+    start = std::chrono::steady_clock::now();
+    for(unsigned round=0; round<rounds; round++){
+      unsigned char * out = buffer.data();
+      for(auto value: values)
+        out = writeVarLen(out, value);
+      bytes += out - buffer.data();
     }
+    report("raw", start, bytes);
+  }
+}
+
+
+//one benchmark workload, as reported and saved in a baseline
+struct BenchResult{
+  std::string name{};
+  size_t events{};
+  size_t bytes{};
+  double seconds{};
+  long peakRssKb{};
+  double allocationsPerEvent{};
+
+  double eventsPerSecond() const{
+    return events / seconds;
+  }
+  double bytesPerSecond() const{
+    return bytes / seconds;
   }
 };
 
+//peak resident set size since the last reset, in KiB
+long peakRssKb(){
+  std::ifstream status("/proc/self/status");
+  std::string line{};
+  while(std::getline(status, line))
+    if(line.rfind("VmHWM:", 0) == 0) return std::atol(line.c_str() + 6);
+  return 0;
+}
+void resetPeakRss(){
+  std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+//run work until it took at least half a second, work returns the number
+//of events and bytes it produced
+template<typename Work>
+BenchResult benchWorkload(const std::string & name, Work work){
+  BenchResult result{};
+  result.name = name;
+  resetPeakRss();
+  size_t allocations = allocationCount;
+  auto start = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed{};
+  do{
+    auto [events, bytes] = work();
+    result.events += events;
+    result.bytes += bytes;
+    elapsed = std::chrono::steady_clock::now() - start;
+  }while(elapsed.count() < 0.5);
+  result.seconds = elapsed.count();
+  result.peakRssKb = peakRssKb();
+  result.allocationsPerEvent = double(allocationCount - allocations) / std::max<size_t>(result.events, 1);
+  return result;
+}
+
+//encode tracks one after the other into memory, as the builder does on one thread
+BenchResult benchTracks(const std::string & name, const std::vector<Track> & tracks,
+                        const std::vector<Track> & patterns = {}){
+  return benchWorkload(name, [&]{
+    std::vector<unsigned char> buffer{};
+    size_t events = 0;
+    for(size_t i=0; i<tracks.size(); i++)
+      events += MidiBuilder::buildTrack(tracks[i], i, buffer, nullptr, BuildOptions{}, patterns).events;
+    return std::pair<size_t, size_t>(events, buffer.size());
+  });
+}
+
+void benchNotes(Track & track, unsigned kind, unsigned i){
+  TrackEvent event{};
+  event.kind = kind;
+  event.deltaTime = i % 7 ? 0 : 240;
+  event.duration = 30 + i % 500;
+  event.velocity = 64 + i % 64;
+  event.firstNote = track.noteNumbers.size();
+  event.noteCount = kind == 5 ? 3 : kind;
+  for(unsigned n=0; n<event.noteCount; n++)
+    track.noteNumbers.push_back(36 + (i * 7 + n * 4) % 60);
+  track.events.push_back(event);
+}
+
+std::vector<Track> benchSingleNotes(){
+  std::vector<Track> tracks(1);
+  for(unsigned i=0; i<1000000; i++)
+    benchNotes(tracks[0], 1, i);
+  return tracks;
+}
+
+std::vector<Track> benchChords(){
+  std::vector<Track> tracks(1);
+  for(unsigned i=0; i<250000; i++)
+    benchNotes(tracks[0], 4, i);
+  return tracks;
+}
+
+std::vector<Track> benchHeldNotes(){
+  std::vector<Track> tracks(1);
+  for(unsigned i=0; i<500000; i++)
+    benchNotes(tracks[0], 5, i);
+  return tracks;
+}
+
+std::vector<Track> benchArpeggio(){
+  std::vector<Track> tracks(1);
+  TrackEvent event{};
+  event.kind = 9;
+  event.duration = 60;
+  event.velocity = 100;
+  event.number = 1000000;
+  event.noteCount = 128;
+  for(unsigned n=0; n<128; n++)
+    tracks[0].noteNumbers.push_back(n);
+  tracks[0].events.push_back(event);
+  return tracks;
+}
+
+//control ramps over the whole range, and pitch wheel ramps, so that most
+//steps change the value
+std::vector<Track> benchRamps(unsigned kind){
+  std::vector<Track> tracks(1);
+  for(unsigned i=0; i<2000; i++){
+    TrackEvent event{};
+    event.kind = kind + i % 2;
+    event.number = 7;
+    event.startValue = i % 4 < 2 ? 0 : (i % 2 ? 0x3fff : 127);
+    event.endValue = i % 4 < 2 ? (i % 2 ? 0x3fff : 127) : 0;
+    event.rampDuration = 960;
+    event.steps = 1000;
+    event.shape = kind == 22 ? i % 3 : 0;
+    event.maxError = kind == 22 ? 2 : 0;
+    event.minInterval = kind == 22 ? 10 : 0;
+    tracks[0].events.push_back(event);
+  }
+  return tracks;
+}
+
+//a bar of notes, a chord and a control change, repeated 100k times on 4
+//channels
+Song benchPatterns(){
+  Song song{};
+  Track & bar = song.addPattern();
+  for(unsigned i=0; i<16; i++)
+    benchNotes(bar, 1, i);
+  bar.chord(0, 240, 90, {48, 52, 55}).controlChange(0, 7, 100);
+  Track & track = song.addTrack();
+  for(unsigned channel=0; channel<4; channel++)
+    track.channel(channel).repeat(0, 0, 25000);
+  return song;
+}
+
+std::vector<Track> benchManyTracks(){
+  std::vector<Track> tracks(256);
+  for(unsigned t=0; t<tracks.size(); t++){
+    TrackEvent channel{};
+    channel.kind = 12;
+    channel.number = t % 16;
+    tracks[t].events.push_back(channel);
+    for(unsigned i=0; i<4000; i++)
+      benchNotes(tracks[t], 1 + i % 3, i + t);
+  }
+  return tracks;
+}
+
+std::string benchScript(){
+  std::string script = "1\n4\n480\n";
+  for(unsigned t=0; t<4; t++){
+    script += "12 " + std::to_string(t) + "\n10 " + std::to_string(t * 8) + "\n";
+    for(unsigned i=0; i<50000; i++){
+      script += "1 0 120 100 " + std::to_string(40 + i % 40) + "\n";
+      script += "3 0 240 90 48 52 55\n";
+      script += "11 10 7 " + std::to_string(i % 128) + "\n";
+      script += "9 0 60 100 8 4 0 48 50 52 55\n";
+    }
+    script += "20 7 0 0 127 960 64\n0\n";
+  }
+  return script + "bench.mid\n";
+}
+
+//synthetic songs for every event builder, generated in memory. each song
+//is freed before the next one, so that the peak RSS is its own.
+std::vector<BenchResult> runBenchmarks(){
+  std::vector<BenchResult> results{};
+  results.push_back(benchTracks("notes, 1M in one track", benchSingleNotes()));
+  results.push_back(benchTracks("chords, 250k of 4 notes", benchChords()));
+  results.push_back(benchTracks("held notes, 500k of 3 notes", benchHeldNotes()));
+  results.push_back(benchTracks("arpeggio, 1M notes from 128", benchArpeggio()));
+  results.push_back(benchTracks("ramps, 2000 of 1000 steps", benchRamps(20)));
+  results.push_back(benchTracks("shaped ramps, thinned", benchRamps(22)));
+  results.push_back(benchTracks("256 tracks of 4000 notes", benchManyTracks()));
+  {
+    Song song = benchPatterns();
+    results.push_back(benchTracks("pattern, 100k repeats", song.tracks, song.patterns));
+  }
+
+  //whole files: script parsing, header, tracks and the sink
+  std::string script = benchScript();
+  std::string path = "/tmp/midibuilder-bench.mid";
+  results.push_back(benchWorkload("batch script, 4 tracks", [&]{
+    {
+      ScriptReader input(script);
+      buildScript(input, path, BuildOptions{});
+    }
+    MidiFileReader file(path);
+    size_t events = 0;
+    for(const auto & chunk: file.trackChunks)
+      events += decodeEvents(chunk.data, chunk.size).size();
+    struct stat info{};
+    ::stat(path.c_str(), &info);
+    return std::pair<size_t, size_t>(events, info.st_size);
+  }));
+  ::unlink(path.c_str());
+
+  return results;
+}
+
+//one benchmark per line, so that a baseline can be read back line by line
+void saveBenchmarks(const std::vector<BenchResult> & results, const std::string & path){
+  std::ofstream out(path);
+  out << "{\"benchmarks\": [\n";
+  for(size_t i=0; i<results.size(); i++){
+    const BenchResult & r = results[i];
+    out << "  {\"name\": \"" << r.name << "\""
+        << ", \"events\": " << r.events
+        << ", \"bytes\": " << r.bytes
+        << ", \"seconds\": " << r.seconds
+        << ", \"eventsPerSecond\": " << r.eventsPerSecond()
+        << ", \"bytesPerSecond\": " << r.bytesPerSecond()
+        << ", \"peakRssKb\": " << r.peakRssKb
+        << ", \"allocationsPerEvent\": " << r.allocationsPerEvent
+        << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "]}\n";
+  if(!out) throw std::runtime_error("cannot write " + path);
+}
+
+//the value of "key": in a line of a saved baseline
+double baselineValue(const std::string & line, const std::string & key){
+  size_t at = line.find("\"" + key + "\": ");
+  return at == std::string::npos ? NAN : std::atof(line.c_str() + at + key.size() + 4);
+}
+
+//compare with a saved baseline. throughput more than 10% lower, or more
+//allocations per event, is a regression.
+bool compareBenchmarks(const std::vector<BenchResult> & results, const std::string & path){
+  std::ifstream in(path);
+  if(!in) throw std::runtime_error("cannot open " + path);
+  bool regressed = false;
+  std::string line{};
+  while(std::getline(in, line)){
+    for(const auto & r: results){
+      if(line.find("\"name\": \"" + r.name + "\"") == std::string::npos) continue;
+      double eventsPerSecond = baselineValue(line, "eventsPerSecond");
+      double allocationsPerEvent = baselineValue(line, "allocationsPerEvent");
+      double change = r.eventsPerSecond() / eventsPerSecond - 1;
+      bool slower = change < -0.10;
+      bool allocates = r.allocationsPerEvent > allocationsPerEvent + 0.01;
+      std::cout << r.name << ": " << (change >= 0 ? "+" : "") << change * 100 << "% events/s";
+      if(slower || allocates){
+        std::cout << "  REGRESSION";
+        if(allocates) std::cout << " (" << allocationsPerEvent << " -> " << r.allocationsPerEvent << " allocations/event)";
+        regressed = true;
+      }
+      std::cout << std::endl;
+    }
+  }
+  return !regressed;
+}
+
+//--bench [--bench-save baseline.json] [--bench-compare baseline.json]
+int bench(const std::string & savePath, const std::string & comparePath){
+  benchVarLen();
+  std::vector<BenchResult> results = runBenchmarks();
+  for(const auto & r: results){
+    std::cout << r.name << ": "
+              << r.eventsPerSecond() / 1e6 << " Mevents/s, "
+              << r.bytesPerSecond() / 1e6 << " MB/s, "
+              << r.peakRssKb / 1024 << " MiB peak RSS, "
+              << r.allocationsPerEvent << " allocations/event" << std::endl;
+  }
+  if(!savePath.empty()) saveBenchmarks(results, savePath);
+  if(!comparePath.empty() && !compareBenchmarks(results, comparePath)) return 1;
+  return 0;
+}
+
 
 int main(int argc, char ** argv){
-  srand(time(0));
-  MidiBuilder midiBuilder;
+  //--batch [script]: read the whole script (default stdin) with no prompts
+  //-o file: write to file ("-" for stdout) instead of the name in the script
+  //-j jobs: number of threads encoding tracks (default: one per core)
+  //--running-status: leave out repeated status bytes
+  //--verify: decode every track back, and report the track sizes
+  //--validate: check the structure of every track encoded
+  //--cache dir: keep encoded tracks in dir, only tracks that changed are encoded
+  //--repair-notes: merge overlapping notes, drop stray note-offs, end stuck notes
+  //--transpose n, --velocity x, --division n, --quantize ticks: reshape the tracks
+  //--manifest file: build every song of the manifest on -j threads
+  //--live out [--tempo bpm]: play the script in real time to out ("-" for stdout)
+  //--rewrite file.mid: decode file.mid and encode it again to the -o file
+  //--disassemble file.mid: print file.mid as a batch script
+  //--to-binary/--to-text script: convert a script to the -o file (default stdout)
+  //--seed n: seed of random arpeggios, the same seed gives the same file
+  //--flatten: merge the tracks into one, as a type 0 file
+  //--bench: run the benchmarks (-DMIDIBUILDER_BENCH), --bench-save/--bench-compare baseline.json
+  //--stats=json: print counters and timers of the build (-DMIDIBUILDER_STATS)
+  //--serve socket: build the framed scripts of clients, "-" for stdin/stdout
+  //--load socket script: send script to a server -n times over -c clients
+  bool batch = false;
+  std::string rewritePath{};
+  std::string disassemblePath{};
+  std::string convertPath{};
+  std::string manifestPath{};
+  std::string livePath{};
+  double tempo = 120;
+  bool convertToBinary = false;
+  bool bench = false;
+  bool stats = false;
+  std::string benchSavePath{};
+  std::string benchComparePath{};
+  std::string servePath{};
+  std::string loadPath{};
+  std::string loadScriptPath{};
+  size_t loadJobs = 10000;
+  unsigned loadClients = 4;
+  unsigned loadWindow = 16;
+  BuildOptions options{};
+  options.jobs = std::max(1u, std::thread::hardware_concurrency());
+  options.seed = time(0);
+  std::string scriptPath{"-"};
+  std::string outputPath{};
+  for(int i=1;i<argc;i++){
+    std::string arg = argv[i];
+    if(arg == "--bench"){
+      if(!benchmarks){
+        std::cerr << "--bench needs a build with -DMIDIBUILDER_BENCH" << std::endl;
+        return 2;
+      }
+      bench = true;
+    }
+    else if(arg == "--bench-save" && i + 1 < argc){
+      benchSavePath = argv[++i];
+    }
+    else if(arg == "--bench-compare" && i + 1 < argc){
+      benchComparePath = argv[++i];
+    }
+    else if(arg == "--batch"){
+      batch = true;
+      if(i + 1 < argc && argv[i + 1][0] != '-') scriptPath = argv[++i];
+    }
+    else if(arg == "-o" && i + 1 < argc){
+      outputPath = argv[++i];
+    }
+    else if(arg == "-j" && i + 1 < argc){
+      options.jobs = std::max(1, std::atoi(argv[++i]));
+    }
+    else if(arg == "--running-status"){
+      options.runningStatus = true;
+    }
+    else if(arg == "--verify"){
+      options.verify = true;
+    }
+    else if(arg == "--validate"){
+      options.validate = true;
+    }
+    else if(arg == "--repair-notes"){
+      options.repairNotes = true;
+    }
+    else if(arg == "--cache" && i + 1 < argc){
+      options.cacheDirectory = argv[++i];
+    }
+    else if(arg == "--transpose" && i + 1 < argc){
+      options.transform.transpose = std::atoi(argv[++i]);
+    }
+    else if(arg == "--velocity" && i + 1 < argc){
+      options.transform.velocityScale = std::max(0.0, std::atof(argv[++i]));
+    }
+    else if(arg == "--division" && i + 1 < argc){
+      options.transform.toDivision = std::clamp(std::atoi(argv[++i]), 0, 0x7fff);
+    }
+    else if(arg == "--quantize" && i + 1 < argc){
+      options.transform.grid = std::strtoul(argv[++i], nullptr, 0);
+    }
+    else if(arg == "--flatten"){
+      options.flatten = true;
+    }
+    else if(arg == "--seed" && i + 1 < argc){
+      options.seed = std::strtoull(argv[++i], nullptr, 0);
+    }
+    else if(arg == "--rewrite" && i + 1 < argc){
+      rewritePath = argv[++i];
+    }
+    else if(arg == "--disassemble" && i + 1 < argc){
+      disassemblePath = argv[++i];
+    }
+    else if((arg == "--to-binary" || arg == "--to-text") && i + 1 < argc){
+      convertToBinary = arg == "--to-binary";
+      convertPath = scriptPath = argv[++i];
+    }
+    else if(arg == "--stats=json"){
+      if(!collectStats){
+        std::cerr << "--stats needs a build with -DMIDIBUILDER_STATS" << std::endl;
+        return 2;
+      }
+      stats = true;
+    }
+    else if(arg == "--manifest" && i + 1 < argc){
+      manifestPath = argv[++i];
+    }
+    else if(arg == "--live" && i + 1 < argc){
+      livePath = argv[++i];
+    }
+    else if(arg == "--tempo" && i + 1 < argc){
+      tempo = std::atof(argv[++i]);
+      if(!(tempo > 0)) tempo = 120;
+    }
+    else if(arg == "--serve" && i + 1 < argc){
+      servePath = argv[++i];
+    }
+    else if(arg == "--load" && i + 2 < argc){
+      loadPath = argv[++i];
+      loadScriptPath = argv[++i];
+    }
+    else if(arg == "-n" && i + 1 < argc){
+      loadJobs = std::strtoull(argv[++i], nullptr, 0);
+    }
+    else if(arg == "-c" && i + 1 < argc){
+      loadClients = std::max(1, std::atoi(argv[++i]));
+    }
+    else if(arg == "--window" && i + 1 < argc){
+      loadWindow = std::max(1, std::atoi(argv[++i]));
+    }
+    else{
+      std::cerr << "usage: " << argv[0] << " [--batch [script]] [-o file] [-j jobs] [--running-status] [--verify] [--validate]\n"
+                << "       [--seed n] [--flatten] [--cache dir] [--stats=json] [--rewrite file.mid -o file] [--disassemble file.mid]\n"
+                << "       [--to-binary script [-o file]] [--to-text script [-o file]]\n"
+                << "       [--transpose semitones] [--velocity scale] [--division ticks] [--quantize ticks]\n"
+                << "       [--repair-notes]\n"
+                << "       [--manifest file] [--live out [--tempo bpm]]\n"
+                << "       [--bench [--bench-save baseline.json] [--bench-compare baseline.json]]\n"
+                << "       [--serve socket|-] [--load socket script [-n jobs] [-c clients] [--window jobs]]" << std::endl;
+      return 2;
+    }
+  }
+
+  try{
+    if(bench){
+      return ::bench(benchSavePath, benchComparePath);
+    }
+    else if(!servePath.empty()){
+      return serve(servePath, options);
+    }
+    else if(!manifestPath.empty()){
+      return runManifest(manifestPath, options);
+    }
+    else if(!livePath.empty()){
+      ScriptFile file(scriptPath);
+      ScriptReader input(file.view());
+      ScriptParser script(input);
+      return live(script.song, livePath, tempo, options);
+    }
+    else if(!loadPath.empty()){
+      return loadTest(loadPath, loadScriptPath, loadJobs, loadClients, loadWindow);
+    }
+    else if(!disassemblePath.empty()){
+      MidiFileReader file(disassemblePath);
+      std::string name = disassemblePath.substr(disassemblePath.find_last_of('/') + 1);
+      name = name.substr(0, name.rfind('.')) + "-rebuilt.mid";
+      std::ios::sync_with_stdio(false);
+      disassemble(file, name, std::cout);
+    }
+    else if(!convertPath.empty()){
+      ScriptFile file(convertPath);
+      ScriptReader input(file.view());
+      ScriptParser script(input);
+      std::ofstream output{};
+      if(!outputPath.empty() && outputPath != "-"){
+        output.open(outputPath, std::ios::binary);
+        if(!output) throw std::runtime_error("cannot open " + outputPath);
+      }
+      std::ostream & out = output.is_open() ? output : std::cout;
+      ScriptWriter writer(out, convertToBinary);
+      writeScript(writer, script.song, script.filename);
+      out.flush();
+      if(!out) throw std::runtime_error("cannot write " + (output.is_open() ? outputPath : std::string("stdout")));
+    }
+    else if(!rewritePath.empty()){
+      if(outputPath.empty()) throw std::runtime_error("--rewrite needs an -o file");
+      auto start = std::chrono::steady_clock::now();
+      MidiFileReader file(rewritePath);
+      MidiSink sink(outputPath);
+      MidiBuilder midiBuilder(sink, options);
+      midiBuilder.write(file);
+      sink.finish();
+      if(options.verify)
+        printReports(midiBuilder.trackReports());
+      else if(options.repairNotes)
+        printRepairs(midiBuilder.trackReports());
+      if(stats){
+        std::chrono::duration<double> total = std::chrono::steady_clock::now() - start;
+        printStats(std::cerr, 0, total.count(), midiBuilder.trackReports(), sink.stats());
+      }
+    }
+    else if(batch){
+      ScriptFile file(scriptPath);
+      ScriptReader input(file.view());
+      buildScript(input, outputPath, options, stats);
+    }
+    else{
+      ScriptReader input;
+      buildScript(input, outputPath, options, stats);
+    }
+  }
+  catch(const ScriptError & e){
+    std::cerr << scriptPath << ":" << e.line << ":" << e.column << ": "
+              << e.what() << std::endl;
+    return 1;
+  }
+  catch(const std::exception & e){
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
   return 0;
 }
 
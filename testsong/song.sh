@@ -1 +1 @@
-cat header track1 track2 footer | ../a.out
+cat header track1 track2 footer | ../a.out --batch